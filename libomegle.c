@@ -1,428 +1,648 @@
-/*
- * libfacebook
- *
- * libfacebook is the property of its developers.  See the COPYRIGHT file
- * for more details.
- *
- * This program is free software: you can redistribute it and/or modify
- * it under the terms of the GNU General Public License as published by
- * the Free Software Foundation, either version 3 of the License, or
- * (at your option) any later version.
- *
- * This program is distributed in the hope that it will be useful,
- * but WITHOUT ANY WARRANTY; without even the implied warranty of
- * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
- * GNU General Public License for more details.
- *
- * You should have received a copy of the GNU General Public License
- * along with this program.  If not, see <http://www.gnu.org/licenses/>.
- */
-
-#include "libomegle.h"
-#include "om_connection.h"
-
-#include <json-glib/json-glib.h>
-
-static void om_got_events(OmegleAccount *oma, gchar *response, gsize len,
-		gpointer userdata);
-
-/******************************************************************************/
-/* PRPL functions */
-/******************************************************************************/
-
-static const char *om_list_icon(PurpleAccount *account, PurpleBuddy *buddy)
-{
-	return "omegle";
-}
-
-static GList *om_statuses(PurpleAccount *account)
-{
-	GList *types = NULL;
-	PurpleStatusType *status;
-	
-	status = purple_status_type_new_full(PURPLE_STATUS_AVAILABLE, NULL, NULL, FALSE, FALSE, FALSE);
-	types = g_list_append(types, status);
-
-	return types;
-}
-
-static void om_login(PurpleAccount *account)
-{
-	PurpleBuddy *bud;
-	OmegleAccount *oma;
-	
-	//make sure there's an Omegle buddy on the buddy list
-	bud = purple_find_buddy(account, "omegle");
-	if (bud == NULL)
-	{
-		bud = purple_buddy_new(account, "omegle", "Omegle");
-		purple_blist_add_buddy(bud, NULL, NULL, NULL);
-	}
-	purple_prpl_got_user_status(account, "omegle", purple_primitive_get_id_from_type(PURPLE_STATUS_AVAILABLE), NULL);
-	
-	
-	oma = g_new0(OmegleAccount, 1);
-	oma->account = account;
-	oma->pc = purple_account_get_connection(account);
-	oma->cookie_table = g_hash_table_new_full(g_str_hash, g_str_equal,
-			g_free, g_free);
-	oma->hostname_ip_cache = g_hash_table_new_full(g_str_hash, g_str_equal,
-			g_free, g_free);
-	account->gc->proto_data = oma;
-	
-	//No such thing as a login
-	purple_connection_set_state(purple_account_get_connection(account), PURPLE_CONNECTED);
-	
-}
-
-static void om_close(PurpleConnection *pc)
-{
-	OmegleAccount *oma;
-	GList *ims;
-	
-	g_return_if_fail(pc != NULL);
-	g_return_if_fail(pc->proto_data != NULL);
-	
-	ims = purple_get_ims();
-	//TODO: Loop through all im's and disconnect them all
-	
-	oma = pc->proto_data;
-	
-	while (oma->conns != NULL)
-		om_connection_destroy(oma->conns->data);
-	while (oma->dns_queries != NULL) {
-		PurpleDnsQueryData *dns_query = oma->dns_queries->data;
-		oma->dns_queries = g_slist_remove(oma->dns_queries, dns_query);
-		purple_dnsquery_destroy(dns_query);
-	}
-
-	g_hash_table_destroy(oma->cookie_table);
-	g_hash_table_destroy(oma->hostname_ip_cache);
-	
-	g_free(oma);
-}
-
-static void om_convo_closed(PurpleConnection *pc, const char *who)
-{
-	OmegleAccount *oma;
-	gchar *postdata;
-	
-	oma = pc->proto_data;
-	postdata = g_strdup_printf("id=%s", purple_url_encode(who));
-	
-	om_post_or_get(oma, OM_METHOD_POST, NULL, "/disconnect",
-				postdata, NULL, NULL, FALSE);
-				
-	g_free(postdata);
-}
-
-static void om_fetch_events(OmegleAccount *oma, gchar *who)
-{
-	gchar *postdata;
-	
-	postdata = g_strdup_printf("id=%s", purple_url_encode(who));
-	
-	om_post_or_get(oma, OM_METHOD_POST, NULL, "/events",
-				postdata, om_got_events, who, FALSE);
-				
-	g_free(postdata);
-}
-
-static void om_got_events(OmegleAccount *oma, gchar *response, gsize len,
-		gpointer userdata)
-{
-	//[["waiting"], ["connected"]]
-	gchar *who = userdata;
-	const gchar *message;
-	const gchar *event_type;
-	JsonParser *parser;
-	JsonNode *rootnode, *currentnode;
-	JsonArray *array, *current;
-	guint i;
-
-	purple_debug_info("omegle", "got events: %s\n", response?response:"(null)");
-	
-	if (!response || g_str_equal(response, "null"))
-	{
-		g_free(who);
-		return;
-	}
-	
-	parser = json_parser_new();
-	json_parser_load_from_data(parser, response, len, NULL);
-	rootnode = json_parser_get_root(parser);
-	if (!rootnode)
-	{
-		g_object_unref(parser);
-		return;
-	}
-	array = json_node_get_array(rootnode);
-	
-	for(i=0; i<json_array_get_length(array); i++)
-	{
-		currentnode = json_array_get_element(array, i);
-		current = json_node_get_array(currentnode);
-		event_type = json_node_get_string(json_array_get_element(current, 0));
-		if (!event_type)
-		{
-			continue;
-		} else if (g_str_equal(event_type, "waiting")) {
-			serv_got_im(oma->pc, who, "Looking for someone you can chat with. Hang on.", PURPLE_MESSAGE_SYSTEM, time(NULL));
-		} else if (g_str_equal(event_type, "connected")) {
-			serv_got_im(oma->pc, who, "You're now chatting with a random stranger. Say hi!", PURPLE_MESSAGE_SYSTEM, time(NULL));
-		} else if (g_str_equal(event_type, "gotMessage")) {
-			//[["gotMessage","message goes here"]]
-			message = json_node_get_string(json_array_get_element(current, 1));
-			if (message)
-				serv_got_im(oma->pc, who, message, PURPLE_MESSAGE_RECV, time(NULL));
-		} else if (g_str_equal(event_type, "typing")) {
-			serv_got_typing(oma->pc, who, 10, PURPLE_TYPING);
-		} else if (g_str_equal(event_type, "stoppedTyping")) {
-			serv_got_typing(oma->pc, who, 10, PURPLE_TYPED);
-		} else if (g_str_equal(event_type, "strangerDisconnected")) {
-			serv_got_im(oma->pc, who, "Your conversational partner has disconnected", PURPLE_MESSAGE_SYSTEM, time(NULL));
-		}
-	}
-	
-	om_fetch_events(oma, g_strdup(who));
-	
-	g_free(who);
-	g_object_unref(parser);
-}
-
-static void om_start_im_cb(OmegleAccount *oma, gchar *response, gsize len,
-		gpointer userdata)
-{
-	gchar *id;
-	
-	//This should come back with an ID that we pass around
-	id = g_strdup(response);
-	purple_str_strip_char(id, '"');
-	
-	//Start the event loop
-	om_fetch_events(oma, g_strdup(id));
-	
-	g_free(id);
-}
-
-static void om_start_im(PurpleBlistNode *node, gpointer data)
-{
-	PurpleBuddy *buddy;
-	OmegleAccount *oma;
-	PurpleConnection *pc;
-	
-	if(!PURPLE_BLIST_NODE_IS_BUDDY(node))
-		return;
-	buddy = (PurpleBuddy *) node;
-	if (!buddy)
-		return;
-	pc = purple_account_get_connection(buddy->account);
-	oma = pc->proto_data;
-	
-	om_post_or_get(oma, OM_METHOD_POST, NULL, "/start",
-				NULL, om_start_im_cb, NULL, FALSE);
-}
-
-static GList *om_node_menu(PurpleBlistNode *node)
-{
-	GList *m = NULL;
-	PurpleMenuAction *act;
-	PurpleBuddy *buddy;
-	
-	if(PURPLE_BLIST_NODE_IS_BUDDY(node))
-	{
-		buddy = (PurpleBuddy *)node;
-		
-		act = purple_menu_action_new(_("_Start random IM"),
-				PURPLE_CALLBACK(om_start_im),
-				NULL, NULL);
-		m = g_list_append(m, act);
-	}
-	return m;
-}
-
-static unsigned int om_send_typing(PurpleConnection *pc, const gchar *name,
-		PurpleTypingState state)
-{
-	gchar *postdata;
-	OmegleAccount *oma = pc->proto_data;
-	gchar *url;
-
-	g_return_val_if_fail(oma != NULL, 0);
-
-	if (state == PURPLE_TYPING)
-	{
-		url = "/typing";	
-	} else if (state == PURPLE_TYPED)
-	{
-		url = "/stoppedtyping";
-	} else {
-		return 0;
-	}
-	
-	postdata = g_strdup_printf("id=%s", purple_url_encode(name));
-	
-	om_post_or_get(oma, OM_METHOD_POST, NULL, url, postdata, NULL, NULL, FALSE);
-	
-	g_free(postdata);
-	
-	return 10;
-}
-
-static int om_send_im(PurpleConnection *pc, const gchar *who, const gchar *message, PurpleMessageFlags flags)
-{
-	OmegleAccount *oma;
-	gchar *encoded_name;
-	gchar *encoded_message;
-	gchar *postdata;
-	
-	oma = pc->proto_data;
-	encoded_name = g_strdup(purple_url_encode(who));
-	encoded_message = g_strdup(purple_url_encode(message));
-	
-	postdata = g_strdup_printf("id=%s&msg=%s", encoded_name, encoded_message);
-	
-	om_post_or_get(oma, OM_METHOD_POST, NULL, "/send", postdata, NULL, NULL, FALSE);
-
-	g_free(postdata);
-	g_free(encoded_name);
-	g_free(encoded_message);
-
-	return strlen(message);
-}
-
-/******************************************************************************/
-/* Plugin functions */
-/******************************************************************************/
-
-static gboolean plugin_load(PurplePlugin *plugin)
-{
-	PurpleAccountOption *option;
-	PurplePluginInfo *info = plugin->info;
-	PurplePluginProtocolInfo *prpl_info = info->extra_info;
-
-	option = purple_account_option_string_new("Server", "host", "bajor.omegle.com");
-	prpl_info->protocol_options = g_list_append(
-		prpl_info->protocol_options, option);
-		
-	return TRUE;
-}
-
-static gboolean plugin_unload(PurplePlugin *plugin)
-{
-	return TRUE;
-}
-
-static void plugin_init(PurplePlugin *plugin)
-{
-
-}
-
-static PurplePluginProtocolInfo prpl_info = {
-	/* options */
-	OPT_PROTO_NO_PASSWORD,
-
-	NULL,                   /* user_splits */
-	NULL,                   /* protocol_options */
-	NO_BUDDY_ICONS,         /* icon_spec */
-	om_list_icon,           /* list_icon */
-	NULL,                   /* list_emblems */
-	NULL,                   /* status_text */
-	NULL,                   /* tooltip_text */
-	om_statuses,            /* status_types */
-	om_node_menu,           /* blist_node_menu */
-	NULL,                   /* chat_info */
-	NULL,                   /* chat_info_defaults */
-	om_login,               /* login */
-	om_close,               /* close */
-	om_send_im,             /* send_im */
-	NULL,                   /* set_info */
-	om_send_typing,         /* send_typing */
-	NULL,                   /* get_info */
-	NULL,                   /* set_status */
-	NULL,                   /* set_idle */
-	NULL,                   /* change_passwd */
-	NULL,                   /* add_buddy */
-	NULL,                   /* add_buddies */
-	NULL,                   /* remove_buddy */
-	NULL,                   /* remove_buddies */
-	NULL,                   /* add_permit */
-	NULL,                   /* add_deny */
-	NULL,                   /* rem_permit */
-	NULL,                   /* rem_deny */
-	NULL,                   /* set_permit_deny */
-	NULL,                   /* join_chat */
-	NULL,                   /* reject chat invite */
-	NULL,                   /* get_chat_name */
-	NULL,                   /* chat_invite */
-	NULL,                   /* chat_leave */
-	NULL,                   /* chat_whisper */
-	NULL,                   /* chat_send */
-	NULL,                   /* keepalive */
-	NULL,                   /* register_user */
-	NULL,                   /* get_cb_info */
-	NULL,                   /* get_cb_away */
-	NULL,                   /* alias_buddy */
-	NULL,                   /* group_buddy */
-	NULL,                   /* rename_group */
-	NULL,                   /* buddy_free */
-	om_convo_closed,        /* convo_closed */
-	purple_normalize_nocase,/* normalize */
-	NULL,                   /* set_buddy_icon */
-	NULL,                   /* remove_group */
-	NULL,                   /* get_cb_real_name */
-	NULL,                   /* set_chat_topic */
-	NULL,                   /* find_blist_chat */
-	NULL,                   /* roomlist_get_list */
-	NULL,                   /* roomlist_cancel */
-	NULL,                   /* roomlist_expand_category */
-	NULL,                   /* can_receive_file */
-	NULL,                   /* send_file */
-	NULL,                   /* new_xfer */
-	NULL,                   /* offline_message */
-	NULL,                   /* whiteboard_prpl_ops */
-	NULL,                   /* send_raw */
-	NULL,                   /* roomlist_room_serialize */
-	NULL,                   /* unregister_user */
-	NULL,                   /* send_attention */
-	NULL,                   /* attention_types */
-#if PURPLE_MAJOR_VERSION >= 2 && PURPLE_MINOR_VERSION >= 5
-	sizeof(PurplePluginProtocolInfo), /* struct_size */
-	NULL,                   /* get_account_text_table */
-#else
-	(gpointer) sizeof(PurplePluginProtocolInfo)
-#endif
-};
-
-static PurplePluginInfo info = {
-	PURPLE_PLUGIN_MAGIC,
-	2,						/* major_version */
-	3, 						/* minor version */
-	PURPLE_PLUGIN_PROTOCOL, 			/* type */
-	NULL, 						/* ui_requirement */
-	0, 						/* flags */
-	NULL, 						/* dependencies */
-	PURPLE_PRIORITY_DEFAULT, 			/* priority */
-	OMEGLE_PLUGIN_ID,				/* id */
-	"Omegle", 					/* name */
-	OMEGLE_PLUGIN_VERSION, 			/* version */
-	N_("Omegle Protocol Plugin"), 		/* summary */
-	N_("Omegle Protocol Plugin"), 		/* description */
-	"Eion Robb <eionrobb@gmail.com>", 		/* author */
-	"http://pidgin-omegle.googlecode.com/",	/* homepage */
-	plugin_load, 					/* load */
-	plugin_unload, 					/* unload */
-	NULL, 						/* destroy */
-	NULL, 						/* ui_info */
-	&prpl_info, 					/* extra_info */
-	NULL, 						/* prefs_info */
-	NULL, 					/* actions */
-
-							/* padding */
-	NULL,
-	NULL,
-	NULL,
-	NULL
-};
-
-PURPLE_INIT_PLUGIN(facebook, plugin_init, info);
+/*
+ * libfacebook
+ *
+ * libfacebook is the property of its developers.  See the COPYRIGHT file
+ * for more details.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "libomegle.h"
+#include "om_connection.h"
+#include "om_filter.h"
+#include "om_log.h"
+#include "om_session.h"
+#include "om_state.h"
+#include "om_trace.h"
+
+/******************************************************************************/
+/* PRPL functions */
+/******************************************************************************/
+
+static const char *om_list_icon(PurpleAccount *account, PurpleBuddy *buddy)
+{
+	return "omegle";
+}
+
+static GList *om_statuses(PurpleAccount *account)
+{
+	GList *types = NULL;
+	PurpleStatusType *status;
+	
+	status = purple_status_type_new_full(PURPLE_STATUS_AVAILABLE, NULL, NULL, FALSE, FALSE, FALSE);
+	types = g_list_append(types, status);
+
+	return types;
+}
+
+/**
+ * Keep a ready connection open to every server we are likely to use, so
+ * that DNS and the TCP/TLS handshake are out of the way beforehand.
+ */
+static gboolean om_prewarm_cb(gpointer data)
+{
+	OmegleAccount *oma = data;
+	gchar **hosts;
+	guint hosts_len, i, count;
+
+	hosts = om_session_hosts(oma, &hosts_len);
+	count = MAX(1, purple_account_get_int(oma->account, "hedge_count", 1));
+	for (i = 0; i < hosts_len && i < count; i++)
+		om_connection_prewarm(oma, hosts[i], OM_METHOD_POST);
+	g_strfreev(hosts);
+
+	return TRUE;
+}
+
+static void om_login(PurpleAccount *account)
+{
+	PurpleBuddy *bud;
+	OmegleAccount *oma;
+	
+	//make sure there's an Omegle buddy on the buddy list
+	bud = purple_find_buddy(account, "omegle");
+	if (bud == NULL)
+	{
+		bud = purple_buddy_new(account, "omegle", "Omegle");
+		purple_blist_add_buddy(bud, NULL, NULL, NULL);
+	}
+	purple_prpl_got_user_status(account, "omegle", purple_primitive_get_id_from_type(PURPLE_STATUS_AVAILABLE), NULL);
+	
+	
+	oma = g_new0(OmegleAccount, 1);
+	oma->account = account;
+	oma->pc = purple_account_get_connection(account);
+	oma->login_time = g_get_monotonic_time();
+	oma->cookie_table = g_hash_table_new_full(g_str_hash, g_str_equal,
+			g_free, g_free);
+	om_sessions_init(oma);
+	om_rate_limiter_init(oma);
+	om_connection_worker_init(oma);
+	om_filter_init(oma);
+	om_log_init(oma);
+	/* Before anything connects, so it finds the remembered addresses */
+	om_state_init(oma);
+	account->gc->proto_data = oma;
+	
+	//No such thing as a login
+	purple_connection_set_state(purple_account_get_connection(account), PURPLE_CONNECTED);
+
+	om_prewarm_cb(oma);
+	oma->warm_timer = purple_timeout_add_seconds(OM_WARM_CHECK_INTERVAL,
+			om_prewarm_cb, oma);
+	om_standby_refill(oma);
+	
+}
+
+static void om_account_free(OmegleAccount *oma)
+{
+	om_proxy_authorization_free(oma);
+	g_hash_table_destroy(oma->cookie_table);
+	g_free(oma);
+}
+
+static void om_close(PurpleConnection *pc)
+{
+	OmegleAccount *oma;
+	
+	g_return_if_fail(pc != NULL);
+	g_return_if_fail(pc->proto_data != NULL);
+	
+	oma = pc->proto_data;
+	
+	if (oma->warm_timer)
+		purple_timeout_remove(oma->warm_timer);
+
+	/* Say goodbye to every stranger, in one go */
+	oma->closing = TRUE;
+	om_sessions_disconnect_all(oma);
+
+	om_sessions_destroy(oma);
+	om_filter_destroy(oma);
+	om_log_destroy(oma);
+	om_state_destroy(oma);
+	purple_request_close_with_handle(pc);
+
+	/* The goodbyes, and any messages still going out, get a few seconds
+	 * to finish before the account is freed */
+	pc->proto_data = NULL;
+	oma->pc = NULL;
+	om_connection_close_account(oma, (GDestroyNotify)om_account_free);
+}
+
+static void om_convo_closed(PurpleConnection *pc, const char *who)
+{
+	OmegleAccount *oma;
+	
+	oma = pc->proto_data;
+	
+	om_session_close(oma, who);
+}
+
+static void om_start_im(PurpleBlistNode *node, gpointer data)
+{
+	PurpleBuddy *buddy;
+	OmegleAccount *oma;
+	PurpleConnection *pc;
+	
+	if(!PURPLE_BLIST_NODE_IS_BUDDY(node))
+		return;
+	buddy = (PurpleBuddy *) node;
+	if (!buddy)
+		return;
+	pc = purple_account_get_connection(buddy->account);
+	oma = pc->proto_data;
+	
+	om_session_start(oma);
+}
+
+static GList *om_node_menu(PurpleBlistNode *node)
+{
+	GList *m = NULL;
+	PurpleMenuAction *act;
+	PurpleBuddy *buddy;
+	
+	if(PURPLE_BLIST_NODE_IS_BUDDY(node))
+	{
+		buddy = (PurpleBuddy *)node;
+		
+		act = purple_menu_action_new(_("_Start random IM"),
+				PURPLE_CALLBACK(om_start_im),
+				NULL, NULL);
+		m = g_list_append(m, act);
+	}
+	return m;
+}
+
+static unsigned int om_send_typing(PurpleConnection *pc, const gchar *name,
+		PurpleTypingState state)
+{
+	GString *postdata;
+	OmegleAccount *oma = pc->proto_data;
+	gchar *url;
+
+	g_return_val_if_fail(oma != NULL, 0);
+
+	if (state == PURPLE_TYPING)
+	{
+		url = "/typing";	
+	} else if (state == PURPLE_TYPED)
+	{
+		url = "/stoppedtyping";
+	} else {
+		return 0;
+	}
+	
+	postdata = g_string_sized_new(64);
+	om_form_append(postdata, "id", name);
+	
+	om_post_or_get(oma, OM_METHOD_POST, om_session_host(oma, name), url,
+			postdata, NULL, NULL);
+	
+	g_string_free(postdata, TRUE);
+	
+	return 10;
+}
+
+static int om_send_im(PurpleConnection *pc, const gchar *who, const gchar *message, PurpleMessageFlags flags)
+{
+	OmegleAccount *oma;
+	GString *postdata;
+	
+	oma = pc->proto_data;
+	
+	/* Sized for the worst case, where every byte needs escaping */
+	postdata = g_string_sized_new(64 + 3 * strlen(message));
+	om_form_append(postdata, "id", who);
+	om_form_append(postdata, "msg", message);
+	
+	om_post_or_get(oma, OM_METHOD_POST, om_session_host(oma, who), "/send",
+			postdata, NULL, NULL);
+	om_session_touch(oma, who);
+	om_log_append(oma, who, OM_LOG_SENT, message);
+
+	g_string_free(postdata, TRUE);
+
+	return strlen(message);
+}
+
+static gint64 om_stats_average_ms(gint64 total_usec, guint count)
+{
+	if (count == 0)
+		return 0;
+	return total_usec / count / 1000;
+}
+
+static void om_show_stats(PurplePluginAction *action)
+{
+	PurpleConnection *pc = action->context;
+	OmegleAccount *oma;
+	OmegleStats *stats;
+	GString *text;
+	gint64 plain_ms, hedged_ms;
+	guint rate_deferred, i;
+
+	g_return_if_fail(pc != NULL && pc->proto_data != NULL);
+	oma = pc->proto_data;
+	stats = &oma->stats;
+
+	plain_ms = om_stats_average_ms(stats->match_usec, stats->matches);
+	hedged_ms = om_stats_average_ms(stats->hedged_match_usec,
+			stats->hedged_matches);
+
+	text = g_string_new(NULL);
+	g_string_append_printf(text, "<b>Matches:</b> %u, average %" G_GINT64_FORMAT " ms<br>",
+			stats->matches, plain_ms);
+	g_string_append_printf(text, "<b>Hedged matches:</b> %u, average %" G_GINT64_FORMAT " ms<br>",
+			stats->hedged_matches, hedged_ms);
+	g_string_append_printf(text, "<b>Won by a secondary server:</b> %u<br>",
+			stats->hedge_secondary_wins);
+	g_string_append_printf(text, "<b>Extra sessions disconnected:</b> %u<br>",
+			stats->hedge_losers);
+	g_string_append_printf(text, "<b>Standby sessions claimed:</b> %u (%u already matched)<br>",
+			stats->standby_claims, stats->standby_instant_matches);
+	g_string_append_printf(text, "<b>Standby sessions expired:</b> %u<br>",
+			stats->standby_expired);
+	g_string_append_printf(text, "<b>Connects on demand:</b> %u, average %" G_GINT64_FORMAT " ms<br>",
+			stats->cold_connects,
+			om_stats_average_ms(stats->cold_connect_usec, stats->cold_connects));
+	g_string_append_printf(text, "<b>Pre-warmed connects:</b> %u, average %" G_GINT64_FORMAT " ms<br>",
+			stats->warm_connects,
+			om_stats_average_ms(stats->warm_connect_usec, stats->warm_connects));
+	g_string_append_printf(text, "<b>Requests sent on a pre-warmed connection:</b> %u (%u expired unused)<br>",
+			stats->warm_hits, stats->warm_expired);
+	g_string_append_printf(text, "<b>Connections kept alive for reuse:</b> %u<br>",
+			stats->conns_recycled);
+	g_string_append_printf(text, "<b>Requests retried after the server dropped a kept connection:</b> %u<br>",
+			stats->stale_retries);
+	g_string_append_printf(text, "<b>Requests timed out:</b> %u<br>",
+			stats->requests_timed_out);
+	g_string_append_printf(text, "<b>Polls in flight:</b> %u now, %u peak<br>",
+			oma->polls_active, stats->polls_peak);
+	g_string_append_printf(text, "<b>Polls deferred:</b> %u, backed off: %u, restarted: %u<br>",
+			stats->polls_deferred, stats->poll_backoffs, stats->poll_restarts);
+	rate_deferred = 0;
+	for (i = 0; i < OM_RATE_CLASSES; i++)
+		rate_deferred += stats->rate_deferred[i];
+	g_string_append_printf(text, "<b>Rate limited:</b> %u control, %u send, %u events, %u typing",
+			stats->rate_deferred[OM_RATE_CONTROL], stats->rate_deferred[OM_RATE_SEND],
+			stats->rate_deferred[OM_RATE_EVENTS], stats->rate_deferred[OM_RATE_TYPING]);
+	g_string_append_printf(text, ", average wait %" G_GINT64_FORMAT " ms<br>",
+			om_stats_average_ms(stats->rate_wait_usec, rate_deferred));
+	g_string_append_printf(text, "<b>Buffered responses:</b> %" G_GSIZE_FORMAT " KiB now, %" G_GSIZE_FORMAT " KiB peak<br>",
+			oma->buffered / 1024, stats->buffered_peak / 1024);
+	g_string_append_printf(text, "<b>Responses aborted as too large:</b> %u, polls paused for memory: %u<br>",
+			stats->oversized_responses, stats->polls_paused);
+	g_string_append_printf(text, "<b>Spam bots dropped:</b> %u matched a phrase, %u flooding, %u typing too fast<br>",
+			stats->spam_matched, stats->spam_flooded, stats->spam_too_fast);
+	g_string_append_printf(text, "<b>Network outages:</b> %u, recovered from: %u<br>",
+			stats->network_losses, stats->network_recoveries);
+	g_string_append_printf(text, "<b>Event streams:</b> %u, batches streamed: %u<br>",
+			stats->streams, stats->streamed_batches);
+	g_string_append_printf(text, "<b>Messages and typing changes:</b> %u, shown in %u UI updates<br>",
+			stats->ui_events, stats->ui_updates);
+	g_string_append_printf(text, "<b>Login to first match:</b> %" G_GINT64_FORMAT " ms",
+			stats->first_match_usec / 1000);
+	g_string_append_printf(text, " (restored %u addresses, %u cookies)<br>",
+			stats->warm_start_addresses, stats->warm_start_cookies);
+	if (stats->matches > 0 && stats->hedged_matches > 0)
+		g_string_append_printf(text, "<b>Time saved per hedged match:</b> %" G_GINT64_FORMAT " ms<br>",
+				plain_ms - hedged_ms);
+
+	purple_notify_formatted(pc, _("Omegle Statistics"), _("Omegle Statistics"),
+			NULL, text->str, NULL, NULL);
+
+	g_string_free(text, TRUE);
+}
+
+static void om_search_transcripts_cb(PurpleConnection *pc, const gchar *query)
+{
+	OmegleAccount *oma = pc->proto_data;
+	gchar *results;
+
+	if (query == NULL || *query == '\0')
+		return;
+
+	results = om_log_search(oma, query);
+	if (results == NULL)
+		return;
+
+	purple_notify_formatted(pc, _("Omegle Transcripts"), _("Search results"),
+			NULL, results, NULL, NULL);
+	g_free(results);
+}
+
+static void om_search_transcripts(PurplePluginAction *action)
+{
+	PurpleConnection *pc = action->context;
+	OmegleAccount *oma;
+
+	g_return_if_fail(pc != NULL && pc->proto_data != NULL);
+	oma = pc->proto_data;
+
+	if (oma->log == NULL)
+	{
+		purple_notify_message(pc, PURPLE_NOTIFY_MSG_INFO,
+				_("Omegle Transcripts"), _("Transcripts are turned off"),
+				_("Turn on \"Keep transcripts\" in the account settings."),
+				NULL, NULL);
+		return;
+	}
+
+	purple_request_input(pc, _("Omegle Transcripts"),
+			_("Search transcripts"),
+			_("Enter some text to look for, or id:<session> for a whole conversation."),
+			NULL, FALSE, FALSE, NULL,
+			_("_Search"), G_CALLBACK(om_search_transcripts_cb),
+			_("_Cancel"), NULL,
+			oma->account, NULL, NULL, pc);
+}
+
+static void om_show_trace(PurplePluginAction *action)
+{
+	PurpleConnection *pc = action->context;
+	gchar *dump;
+
+	dump = om_trace_dump(TRUE);
+	purple_notify_formatted(pc, _("Omegle Trace"),
+			_("Recent connection activity"), NULL, dump, NULL, NULL);
+	g_free(dump);
+}
+
+#ifdef OM_ALLOC_PROFILE
+static void om_show_alloc_profile(PurplePluginAction *action)
+{
+	PurpleConnection *pc = action->context;
+	gchar *report;
+
+	report = om_profile_report();
+	purple_notify_formatted(pc, _("Omegle Allocation Profile"),
+			_("Omegle Allocation Profile"), NULL, report, NULL, NULL);
+	g_free(report);
+}
+#endif
+
+static GList *om_actions(PurplePlugin *plugin, gpointer context)
+{
+	GList *m = NULL;
+	PurplePluginAction *act;
+
+	act = purple_plugin_action_new(_("Show statistics"), om_show_stats);
+	m = g_list_append(m, act);
+
+	act = purple_plugin_action_new(_("Search transcripts..."), om_search_transcripts);
+	m = g_list_append(m, act);
+
+	act = purple_plugin_action_new(_("Show trace"), om_show_trace);
+	m = g_list_append(m, act);
+
+#ifdef OM_ALLOC_PROFILE
+	act = purple_plugin_action_new(_("Show allocation profile"), om_show_alloc_profile);
+	m = g_list_append(m, act);
+#endif
+
+	return m;
+}
+
+/******************************************************************************/
+/* Plugin functions */
+/******************************************************************************/
+
+static gboolean plugin_load(PurplePlugin *plugin)
+{
+	PurpleAccountOption *option;
+	PurplePluginInfo *info = plugin->info;
+	PurplePluginProtocolInfo *prpl_info = info->extra_info;
+
+	om_connection_pool_init();
+
+	option = purple_account_option_string_new("Server", "host", "bajor.omegle.com");
+	prpl_info->protocol_options = g_list_append(
+		prpl_info->protocol_options, option);
+
+	option = purple_account_option_int_new("Hedged start servers", "hedge_count", 1);
+	prpl_info->protocol_options = g_list_append(
+		prpl_info->protocol_options, option);
+
+	option = purple_account_option_int_new("Hedged start delay (ms)", "hedge_delay", 500);
+	prpl_info->protocol_options = g_list_append(
+		prpl_info->protocol_options, option);
+
+	option = purple_account_option_string_new("Extra servers for hedged start", "hedge_hosts", "");
+	prpl_info->protocol_options = g_list_append(
+		prpl_info->protocol_options, option);
+
+	option = purple_account_option_bool_new("Use HTTPS", "use_https", FALSE);
+	prpl_info->protocol_options = g_list_append(
+		prpl_info->protocol_options, option);
+
+	option = purple_account_option_bool_new("Handle responses on a worker thread", "worker_thread", FALSE);
+	prpl_info->protocol_options = g_list_append(
+		prpl_info->protocol_options, option);
+
+	option = purple_account_option_bool_new("Limit request rate", "rate_limit", TRUE);
+	prpl_info->protocol_options = g_list_append(
+		prpl_info->protocol_options, option);
+
+	option = purple_account_option_int_new("Maximum concurrent polls", "max_polls", 8);
+	prpl_info->protocol_options = g_list_append(
+		prpl_info->protocol_options, option);
+
+	option = purple_account_option_bool_new("Stream events if the server can", "stream_events", FALSE);
+	prpl_info->protocol_options = g_list_append(
+		prpl_info->protocol_options, option);
+
+	option = purple_account_option_int_new("Maximum response header size (KiB)", "max_header_kb", OM_DEFAULT_MAX_HEADER_KB);
+	prpl_info->protocol_options = g_list_append(
+		prpl_info->protocol_options, option);
+
+	option = purple_account_option_int_new("Maximum response body size (KiB)", "max_body_kb", OM_DEFAULT_MAX_BODY_KB);
+	prpl_info->protocol_options = g_list_append(
+		prpl_info->protocol_options, option);
+
+	option = purple_account_option_int_new("Maximum decompressed size (KiB)", "max_inflated_kb", OM_DEFAULT_MAX_INFLATED_KB);
+	prpl_info->protocol_options = g_list_append(
+		prpl_info->protocol_options, option);
+
+	option = purple_account_option_int_new("Response memory budget (KiB)", "memory_budget_kb", OM_DEFAULT_MEMORY_BUDGET_KB);
+	prpl_info->protocol_options = g_list_append(
+		prpl_info->protocol_options, option);
+
+	option = purple_account_option_int_new("Pre-warmed connections per server", "warm_connections", 1);
+	prpl_info->protocol_options = g_list_append(
+		prpl_info->protocol_options, option);
+
+	option = purple_account_option_bool_new("Reuse connections (keep-alive)", "keepalive", TRUE);
+	prpl_info->protocol_options = g_list_append(
+		prpl_info->protocol_options, option);
+
+	option = purple_account_option_bool_new("Remember addresses and cookies between logins", "warm_start", TRUE);
+	prpl_info->protocol_options = g_list_append(
+		prpl_info->protocol_options, option);
+
+	option = purple_account_option_int_new("Standby sessions", "standby_pool", 0);
+	prpl_info->protocol_options = g_list_append(
+		prpl_info->protocol_options, option);
+
+	option = purple_account_option_int_new("Standby session expiry (s)", "standby_idle", 60);
+	prpl_info->protocol_options = g_list_append(
+		prpl_info->protocol_options, option);
+
+	option = purple_account_option_bool_new("Turn web addresses into links", "linkify", FALSE);
+	prpl_info->protocol_options = g_list_append(
+		prpl_info->protocol_options, option);
+
+	option = purple_account_option_bool_new("Filter spam bots", "spam_filter", FALSE);
+	prpl_info->protocol_options = g_list_append(
+		prpl_info->protocol_options, option);
+
+	option = purple_account_option_string_new("Spam phrases (comma separated)", "spam_patterns", "kik me,add me on snapchat,my pics,check out my profile");
+	prpl_info->protocol_options = g_list_append(
+		prpl_info->protocol_options, option);
+
+	option = purple_account_option_string_new("Spam phrase file (one per line)", "spam_pattern_file", "");
+	prpl_info->protocol_options = g_list_append(
+		prpl_info->protocol_options, option);
+
+	option = purple_account_option_bool_new("Find a new stranger after dropping a spam bot", "spam_restart", TRUE);
+	prpl_info->protocol_options = g_list_append(
+		prpl_info->protocol_options, option);
+
+	option = purple_account_option_bool_new("Keep transcripts", "transcripts", FALSE);
+	prpl_info->protocol_options = g_list_append(
+		prpl_info->protocol_options, option);
+		
+	return TRUE;
+}
+
+static gboolean plugin_unload(PurplePlugin *plugin)
+{
+	om_connection_pool_destroy();
+
+	return TRUE;
+}
+
+static void plugin_init(PurplePlugin *plugin)
+{
+
+}
+
+static PurplePluginProtocolInfo prpl_info = {
+	/* options */
+	OPT_PROTO_NO_PASSWORD,
+
+	NULL,                   /* user_splits */
+	NULL,                   /* protocol_options */
+	NO_BUDDY_ICONS,         /* icon_spec */
+	om_list_icon,           /* list_icon */
+	NULL,                   /* list_emblems */
+	NULL,                   /* status_text */
+	NULL,                   /* tooltip_text */
+	om_statuses,            /* status_types */
+	om_node_menu,           /* blist_node_menu */
+	NULL,                   /* chat_info */
+	NULL,                   /* chat_info_defaults */
+	om_login,               /* login */
+	om_close,               /* close */
+	om_send_im,             /* send_im */
+	NULL,                   /* set_info */
+	om_send_typing,         /* send_typing */
+	NULL,                   /* get_info */
+	NULL,                   /* set_status */
+	NULL,                   /* set_idle */
+	NULL,                   /* change_passwd */
+	NULL,                   /* add_buddy */
+	NULL,                   /* add_buddies */
+	NULL,                   /* remove_buddy */
+	NULL,                   /* remove_buddies */
+	NULL,                   /* add_permit */
+	NULL,                   /* add_deny */
+	NULL,                   /* rem_permit */
+	NULL,                   /* rem_deny */
+	NULL,                   /* set_permit_deny */
+	NULL,                   /* join_chat */
+	NULL,                   /* reject chat invite */
+	NULL,                   /* get_chat_name */
+	NULL,                   /* chat_invite */
+	NULL,                   /* chat_leave */
+	NULL,                   /* chat_whisper */
+	NULL,                   /* chat_send */
+	NULL,                   /* keepalive */
+	NULL,                   /* register_user */
+	NULL,                   /* get_cb_info */
+	NULL,                   /* get_cb_away */
+	NULL,                   /* alias_buddy */
+	NULL,                   /* group_buddy */
+	NULL,                   /* rename_group */
+	NULL,                   /* buddy_free */
+	om_convo_closed,        /* convo_closed */
+	purple_normalize_nocase,/* normalize */
+	NULL,                   /* set_buddy_icon */
+	NULL,                   /* remove_group */
+	NULL,                   /* get_cb_real_name */
+	NULL,                   /* set_chat_topic */
+	NULL,                   /* find_blist_chat */
+	NULL,                   /* roomlist_get_list */
+	NULL,                   /* roomlist_cancel */
+	NULL,                   /* roomlist_expand_category */
+	NULL,                   /* can_receive_file */
+	NULL,                   /* send_file */
+	NULL,                   /* new_xfer */
+	NULL,                   /* offline_message */
+	NULL,                   /* whiteboard_prpl_ops */
+	NULL,                   /* send_raw */
+	NULL,                   /* roomlist_room_serialize */
+	NULL,                   /* unregister_user */
+	NULL,                   /* send_attention */
+	NULL,                   /* attention_types */
+#if PURPLE_MAJOR_VERSION >= 2 && PURPLE_MINOR_VERSION >= 5
+	sizeof(PurplePluginProtocolInfo), /* struct_size */
+	NULL,                   /* get_account_text_table */
+#else
+	(gpointer) sizeof(PurplePluginProtocolInfo)
+#endif
+};
+
+static PurplePluginInfo info = {
+	PURPLE_PLUGIN_MAGIC,
+	2,						/* major_version */
+	3, 						/* minor version */
+	PURPLE_PLUGIN_PROTOCOL, 			/* type */
+	NULL, 						/* ui_requirement */
+	0, 						/* flags */
+	NULL, 						/* dependencies */
+	PURPLE_PRIORITY_DEFAULT, 			/* priority */
+	OMEGLE_PLUGIN_ID,				/* id */
+	"Omegle", 					/* name */
+	OMEGLE_PLUGIN_VERSION, 			/* version */
+	N_("Omegle Protocol Plugin"), 		/* summary */
+	N_("Omegle Protocol Plugin"), 		/* description */
+	"Eion Robb <eionrobb@gmail.com>", 		/* author */
+	"http://pidgin-omegle.googlecode.com/",	/* homepage */
+	plugin_load, 					/* load */
+	plugin_unload, 					/* unload */
+	NULL, 						/* destroy */
+	NULL, 						/* ui_info */
+	&prpl_info, 					/* extra_info */
+	NULL, 						/* prefs_info */
+	om_actions, 					/* actions */
+
+							/* padding */
+	NULL,
+	NULL,
+	NULL,
+	NULL
+};
+
+PURPLE_INIT_PLUGIN(facebook, plugin_init, info);
@@ -61,6 +61,7 @@
 #include <libpurple/connection.h>
 #include <libpurple/debug.h>
 #include <libpurple/dnsquery.h>
+#include <libpurple/notify.h>
 #include <libpurple/proxy.h>
 #include <libpurple/prpl.h>
 #include <libpurple/request.h>
@@ -75,16 +76,109 @@
 
 typedef struct _OmegleAccount OmegleAccount;
 typedef struct _OmegleBuddy OmegleBuddy;
+typedef struct _OmegleFilter OmegleFilter;
+typedef struct _OmegleLog OmegleLog;
+typedef struct _OmegleSession OmegleSession;
+typedef struct _OmegleState OmegleState;
+typedef struct _OmegleStats OmegleStats;
+typedef struct _OmegleWorker OmegleWorker;
+
+/*
+ * Endpoint classes for outgoing rate limiting, highest priority first.
+ */
+typedef enum
+{
+	OM_RATE_CONTROL = 0,
+	OM_RATE_SEND,
+	OM_RATE_EVENTS,
+	OM_RATE_TYPING,
+	OM_RATE_CLASSES
+} OmegleRateClass;
+
+#include "om_profile.h"
 
 typedef void (*OmegleProxyCallbackFunc)(OmegleAccount *oma, gchar *data, gsize data_len, gpointer user_data);
 
+struct _OmegleStats {
+	guint matches; /**< Sessions matched without hedging */
+	gint64 match_usec;
+	guint hedged_matches;
+	gint64 hedged_match_usec;
+	guint hedge_secondary_wins; /**< Hedged matches not won by the first server */
+	guint hedge_losers; /**< Extra sessions disconnected after a hedge was won */
+	guint standby_claims;
+	guint standby_instant_matches; /**< Claims that already had a stranger */
+	guint standby_expired;
+	guint cold_connects; /**< Connections opened for a waiting request */
+	gint64 cold_connect_usec;
+	guint warm_connects; /**< Connections opened ahead of time */
+	gint64 warm_connect_usec;
+	guint warm_hits;
+	guint warm_expired;
+	guint conns_recycled; /**< Kept open after a response for the next request */
+	guint stale_retries; /**< Requests sent again after a reused socket had closed */
+	guint requests_timed_out; /**< Given up on after hearing nothing for too long */
+	guint polls_peak; /**< Most /events requests in flight at once */
+	guint polls_deferred; /**< Times a poll had to wait for a free slot */
+	guint poll_backoffs;
+	guint poll_restarts; /**< Stranded polls picked up by the watchdog */
+	guint rate_deferred[OM_RATE_CLASSES]; /**< Requests held back, by class */
+	gint64 rate_wait_usec;
+	gsize buffered_peak;
+	guint oversized_responses; /**< Aborted for breaking a size limit */
+	guint polls_paused; /**< Times the memory budget held polls back */
+	guint spam_matched; /**< Strangers dropped for a spam phrase */
+	guint spam_flooded;
+	guint spam_too_fast;
+	guint network_losses; /**< Times the network went away with sessions open */
+	guint network_recoveries; /**< Times polling got going again afterwards */
+	guint streams; /**< /events responses that were event streams */
+	guint streamed_batches;
+	guint ui_events; /**< Messages and typing changes held back for the UI */
+	guint ui_updates; /**< What they were delivered as */
+	gint64 first_match_usec; /**< From login to the first stranger, 0 until then */
+	guint warm_start_addresses; /**< Restored from the last snapshot at login */
+	guint warm_start_cookies;
+};
+
 struct _OmegleAccount {
 	PurpleAccount *account;
 	PurpleConnection *pc;
 	GSList *conns; /**< A list of all active OmegleConnections */
-	GSList *dns_queries;
 	GHashTable *cookie_table;
-	GHashTable *hostname_ip_cache;
+	GHashTable *sessions; /**< id -> OmegleSession */
+	GSList *pending_sessions; /**< OmegleSessions still waiting on /start */
+	GSList *hedges;
+	GSList *standby; /**< Pre-started OmegleSessions nobody has claimed */
+	guint standby_timer;
+	guint warm_timer;
+	GSList *poll_queue; /**< OmegleSessions waiting for a polling slot */
+	guint polls_active;
+	guint poll_watchdog;
+	guint poll_kick_timer;
+	gsize buffered; /**< Bytes of responses held in memory right now */
+	GHashTable *rate_buckets;
+	GSList *rate_queue; /**< OmegleConnections held back by the rate limiter */
+	guint rate_timer;
+	gchar *proxy_username;
+	gchar *proxy_password;
+	gchar *proxy_auth; /**< Base64 of the two above, for Proxy-Authorization */
+	OmegleWorker *worker; /**< Decompresses and parses off the main loop */
+	OmegleFilter *filter; /**< NULL unless spam filtering is on */
+	OmegleLog *log; /**< NULL unless transcripts are kept */
+	OmegleState *state; /**< NULL unless warm starts are on */
+	gint64 login_time; /**< Monotonic usec */
+	gboolean network_down; /**< Sessions are parked until it comes back */
+	gint64 network_lost_time; /**< Start of the current outage, 0 if none */
+	guint recovery_timer;
+	guint recovery_attempts;
+	guint timeouts_in_row; /**< Requests timed out since the server was last heard from */
+	gboolean closing; /**< om_close has run, only farewell requests are left */
+	guint close_timer;
+	GDestroyNotify close_func; /**< Frees the account once they are done */
+	GSList *ui_pending; /**< OmegleSessions with UI updates held back */
+	guint ui_flush_timer;
+	OmegleStats stats;
 };
 
 #endif /* LIBOMEGLE_H */
@@ -19,12 +19,51 @@
  */
 
 #include "om_connection.h"
+#include "om_session.h"
+#include "om_trace.h"
+#include "om_worker.h"
 
 static void om_attempt_connection(OmegleConnection *);
+static void om_connection_pool_remove(OmegleConnection *omconn);
+static void om_connection_deliver(OmegleConnection *omconn, gchar *data,
+		gsize len, gpointer parsed);
+static void om_connection_close_socket(OmegleConnection *omconn);
+static void om_connection_close_soon(OmegleAccount *oma);
+static void om_connection_response_done(OmegleConnection *omconn);
+static gchar *om_connection_pool_key(OmegleAccount *oma, const gchar *host,
+		OmegleMethod method);
+
+/*
+ * Shared by every account.  DNS answers and idle connections depend on
+ * the server and the route to it, not on who is logged in, so running
+ * several accounts shouldn't multiply either.
+ */
+typedef struct _OmegleDnsEntry OmegleDnsEntry;
+
+struct _OmegleDnsEntry {
+	gchar *ip;
+	gint64 expires; /**< Monotonic usec */
+};
+
+static GHashTable *om_dns_cache; /**< hostname -> OmegleDnsEntry */
+static GHashTable *om_dns_queries; /**< hostname -> PurpleDnsQueryData */
+static GHashTable *om_warm_pool; /**< pool key -> GSList of idle OmegleConnections */
+
+static void om_dns_entry_free(OmegleDnsEntry *entry)
+{
+	g_free(entry->ip);
+	g_free(entry);
+}
 
 #include <zlib.h>
 
-static gchar *om_gunzip(const guchar *gzip_data, ssize_t *len_ptr)
+/*
+ * This can run on the worker thread, so it reports problems through
+ * error rather than the debug log.  Output is never allowed to grow past
+ * max_len; a response that would is thrown away and NULL returned.
+ */
+static gchar *om_gunzip(const guchar *gzip_data, ssize_t *len_ptr,
+		gsize max_len, const gchar **error)
 {
 	gsize gzip_data_len	= *len_ptr;
 	z_stream zstr;
@@ -44,7 +83,7 @@ static gchar *om_gunzip(const guchar *gzip_data, ssize_t *len_ptr)
 	if (gzip_err != Z_OK)
 	{
 		g_free(data_buffer);
-		purple_debug_error("omegle", "no built-in gzip support in zlib\n");
+		*error = "no built-in gzip support in zlib";
 		return NULL;
 	}
 	
@@ -59,11 +98,11 @@ static gchar *om_gunzip(const guchar *gzip_data, ssize_t *len_ptr)
 	if (gzip_err == Z_DATA_ERROR)
 	{
 		inflateEnd(&zstr);
-		inflateInit2(&zstr, -MAX_WBITS);
+		gzip_err = inflateInit2(&zstr, -MAX_WBITS);
 		if (gzip_err != Z_OK)
 		{
 			g_free(data_buffer);
-			purple_debug_error("omegle", "Cannot decode gzip header\n");
+			*error = "Cannot decode gzip header";
 			return NULL;
 		}
 		zstr.next_in = (Bytef *)gzip_data;
@@ -77,6 +116,8 @@ static gchar *om_gunzip(const guchar *gzip_data, ssize_t *len_ptr)
 	{
 		//append data to buffer
 		output_string = g_string_append_len(output_string, data_buffer, gzip_len - zstr.avail_out);
+		if (output_string->len > max_len)
+			break;
 		//reset buffer pointer
 		zstr.next_out = (Bytef *)data_buffer;
 		zstr.avail_out = gzip_len;
@@ -86,12 +127,20 @@ static gchar *om_gunzip(const guchar *gzip_data, ssize_t *len_ptr)
 	{
 		output_string = g_string_append_len(output_string, data_buffer, gzip_len - zstr.avail_out);
 	} else {
-		purple_debug_error("omegle", "gzip inflate error\n");
+		*error = "gzip inflate error";
 	}
 	inflateEnd(&zstr);
 
 	g_free(data_buffer);	
 
+	if (output_string->len > max_len)
+	{
+		g_string_free(output_string, TRUE);
+		*error = "decompressed response too large";
+		*len_ptr = 0;
+		return NULL;
+	}
+
 	gchar *output_data = g_strdup(output_string->str);
 	*len_ptr = output_string->len;
 
@@ -100,352 +149,2042 @@ static gchar *om_gunzip(const guchar *gzip_data, ssize_t *len_ptr)
 	return output_data;
 }
 
+/******************************************************************************/
+/* Memory limits */
+/******************************************************************************/
+
+/**
+ * A size limit from the account settings, in bytes.  Zero or less in the
+ * settings means no limit.
+ */
+static gsize om_connection_limit(OmegleAccount *oma, const gchar *option,
+		gint default_kb)
+{
+	gint kb;
+
+	kb = purple_account_get_int(oma->account, option, default_kb);
+	if (kb <= 0)
+		return G_MAXSIZE;
+	return (gsize)kb * 1024;
+}
+
+static void om_memory_charge(OmegleAccount *oma, gsize bytes)
+{
+	oma->buffered += bytes;
+	if (oma->buffered > oma->stats.buffered_peak)
+		oma->stats.buffered_peak = oma->buffered;
+}
+
+static void om_memory_release(OmegleAccount *oma, gsize bytes)
+{
+	gboolean was_over = om_connection_over_budget(oma);
+
+	oma->buffered -= MIN(bytes, oma->buffered);
+
+	/* Polls were held back for this, let them go again */
+	if (was_over && !om_connection_over_budget(oma))
+		om_poll_kick(oma);
+}
+
+/**
+ * Whether the account is holding more response data than it is allowed
+ * to, in which case no new polls should be started.
+ */
+gboolean om_connection_over_budget(OmegleAccount *oma)
+{
+	return oma->buffered > om_connection_limit(oma, "memory_budget_kb",
+			OM_DEFAULT_MEMORY_BUDGET_KB);
+}
+
+/**
+ * Check a response against the size limits as it arrives.  prev_len is
+ * how much had arrived before, so the end of the headers is only looked
+ * for in the new data.
+ */
+static const gchar *om_connection_check_limits(OmegleConnection *omconn,
+		gsize prev_len)
+{
+	OmegleAccount *oma = omconn->oma;
+	const gchar *end, *content_length, *keepalive;
+	gsize start;
+
+	if (omconn->header_len == 0)
+	{
+		start = prev_len > 3 ? prev_len - 3 : 0;
+		end = g_strstr_len(omconn->rx_buf + start, omconn->rx_len - start,
+				"\r\n\r\n");
+		if (end == NULL)
+		{
+			if (omconn->rx_len > om_connection_limit(oma, "max_header_kb",
+					OM_DEFAULT_MAX_HEADER_KB))
+				return "headers too large";
+			return NULL;
+		}
+		omconn->header_len = end - omconn->rx_buf + 4;
+		if (omconn->header_len > om_connection_limit(oma, "max_header_kb",
+				OM_DEFAULT_MAX_HEADER_KB))
+			return "headers too large";
+
+		/* No need to wait for the body if we already know its size */
+		content_length = purple_strcasestr(omconn->rx_buf, "\r\nContent-Length:");
+		if (content_length != NULL && content_length < end)
+		{
+			omconn->has_content_length = TRUE;
+			omconn->content_length = g_ascii_strtoull(content_length + 17,
+					NULL, 10);
+			if (omconn->content_length > om_connection_limit(oma,
+					"max_body_kb", OM_DEFAULT_MAX_BODY_KB))
+				return "body too large";
+		}
+
+		keepalive = purple_strcasestr(omconn->rx_buf, "\r\nConnection: keep-alive");
+		omconn->server_keepalive = (keepalive != NULL && keepalive < end);
+	}
+
+	if (omconn->rx_len - omconn->header_len >
+			om_connection_limit(oma, "max_body_kb", OM_DEFAULT_MAX_BODY_KB))
+		return "body too large";
+
+	return NULL;
+}
+
+/**
+ * Give up on a response that broke the limits.  Whoever made the
+ * request gets an empty response, the same as if the server had sent
+ * nothing.
+ */
+static void om_connection_abort(OmegleConnection *omconn, const gchar *reason)
+{
+	purple_debug_warning("omegle", "aborting %s: %s\n",
+			omconn->url ? omconn->url : omconn->hostname, reason);
+	om_trace(omconn->id, OM_TRACE_ABORTED, omconn->rx_len);
+
+	if (omconn->request != NULL)
+	{
+		omconn->oma->stats.oversized_responses++;
+		om_connection_close_socket(omconn);
+		om_connection_deliver(omconn, NULL, 0, NULL);
+	}
+	om_connection_destroy(omconn);
+}
+
+static void om_connection_close_socket(OmegleConnection *omconn)
+{
+	if (omconn->connect_data != NULL)
+		purple_proxy_connect_cancel(omconn->connect_data);
+	omconn->connect_data = NULL;
+
+	if (omconn->ssl_conn != NULL)
+		purple_ssl_close(omconn->ssl_conn);
+	omconn->ssl_conn = NULL;
+
+	if (omconn->fd >= 0) {
+		close(omconn->fd);
+	}
+	omconn->fd = -1;
+
+	if (omconn->input_watcher > 0)
+		purple_input_remove(omconn->input_watcher);
+	omconn->input_watcher = 0;
+
+	/* Nothing more is coming from the server to wait for */
+	if (omconn->timeout_timer > 0)
+		purple_timeout_remove(omconn->timeout_timer);
+	omconn->timeout_timer = 0;
+}
+
+/**
+ * A request that has heard nothing from the server for too long is on
+ * a socket that died quietly, which a NAT timeout or a change of
+ * network can leave behind without any error.  The connection is
+ * destroyed.  Whoever holds it finds out through lost_func, so a poll
+ * is picked up again by the watchdog; anyone else gets an empty
+ * response, as with an abort.
+ */
+static gboolean om_connection_timeout_cb(gpointer data)
+{
+	OmegleConnection *omconn = data;
+	OmegleAccount *oma = omconn->oma;
+
+	omconn->timeout_timer = 0;
+	purple_debug_warning("omegle", "%s timed out\n",
+			omconn->url ? omconn->url : omconn->hostname);
+	om_trace(omconn->id, OM_TRACE_FAILED, 0);
+	oma->stats.requests_timed_out++;
+
+	/* One could be a slow server, several in a row is the network */
+	if (++oma->timeouts_in_row >= OM_TIMEOUTS_NETWORK_LOST)
+		om_sessions_network_lost(oma);
+
+	if (omconn->lost_func == NULL)
+	{
+		om_connection_close_socket(omconn);
+		om_connection_deliver(omconn, NULL, 0, NULL);
+	}
+	om_connection_destroy(omconn);
+
+	return FALSE;
+}
+
+/**
+ * (Re)start the clock on a request.  It runs from when the request
+ * leaves the rate limiter until the response is complete, and starts
+ * again whenever something arrives, so a stream stays up for as long
+ * as the server keeps talking.
+ */
+static void om_connection_set_deadline(OmegleConnection *omconn)
+{
+	if (omconn->timeout_timer > 0)
+		purple_timeout_remove(omconn->timeout_timer);
+	omconn->timeout_timer = purple_timeout_add_seconds(
+			omconn->rate_class == OM_RATE_EVENTS ?
+				OM_EVENTS_TIMEOUT : OM_REQUEST_TIMEOUT,
+			om_connection_timeout_cb, omconn);
+}
+
 void om_connection_destroy(OmegleConnection *omconn)
 {
+	OmegleAccount *oma = omconn->oma;
+
+	om_trace(omconn->id, OM_TRACE_CLOSED, 0);
 	omconn->oma->conns = g_slist_remove(omconn->oma->conns, omconn);
 
+	/* Whoever is holding on to us must let go */
+	if (omconn->lost_func != NULL)
+		omconn->lost_func(omconn->user_data);
+	om_connection_pool_remove(omconn);
+	omconn->oma->rate_queue = g_slist_remove(omconn->oma->rate_queue, omconn);
+
+	/* The worker still has the response, it gets thrown away when it
+	 * comes back */
+	if (omconn->job != NULL)
+		omconn->job->cancelled = TRUE;
+
 	if (omconn->request != NULL)
 		g_string_free(omconn->request, TRUE);
 
+	if (omconn->rx_buf != NULL)
+		om_memory_release(omconn->oma, omconn->rx_len);
 	g_free(omconn->rx_buf);
 
-	if (omconn->connect_data != NULL)
-		purple_proxy_connect_cancel(omconn->connect_data);
+	if (omconn->stream_buf != NULL)
+	{
+		om_memory_release(omconn->oma, omconn->stream_buf->len);
+		g_string_free(omconn->stream_buf, TRUE);
+	}
+
+	om_connection_close_socket(omconn);
+
+	g_free(omconn->url);
+	g_free(omconn->hostname);
+	g_free(omconn->origin_host);
+	g_free(omconn);
+
+	/* That was the last thing a closing account was waiting for */
+	if (oma->close_func != NULL && oma->conns == NULL)
+		om_connection_close_soon(oma);
+}
+
+static void om_update_cookies(OmegleAccount *oma, const gchar *headers)
+{
+	const gchar *cookie_start;
+	const gchar *cookie_end;
+	gchar *cookie_name;
+	gchar *cookie_value;
+	int header_len;
+
+	g_return_if_fail(headers != NULL);
+
+	header_len = strlen(headers);
+
+	/* look for the next "Set-Cookie: " */
+	/* grab the data up until ';' */
+	cookie_start = headers;
+	while ((cookie_start = strstr(cookie_start, "\r\nSet-Cookie: ")) &&
+			(cookie_start - headers) < header_len)
+	{
+		cookie_start += 14;
+		cookie_end = strchr(cookie_start, '=');
+		cookie_name = g_strndup(cookie_start, cookie_end-cookie_start);
+		cookie_start = cookie_end + 1;
+		cookie_end = strchr(cookie_start, ';');
+		cookie_value= g_strndup(cookie_start, cookie_end-cookie_start);
+		cookie_start = cookie_end;
+
+		g_hash_table_replace(oma->cookie_table, cookie_name,
+				cookie_value);
+	}
+}
+
+void om_connection_set_parser(OmegleConnection *omconn,
+		OmegleParseFunc parse_func, OmegleParsedCallbackFunc parsed_callback,
+		GDestroyNotify parsed_free)
+{
+	omconn->parse_func = parse_func;
+	omconn->parsed_callback = parsed_callback;
+	omconn->parsed_free = parsed_free;
+}
+
+/**
+ * lost_func is called with the user_data if the connection is destroyed
+ * without its response being delivered, so that a caller holding on to
+ * the connection knows to stop.
+ */
+void om_connection_set_lost_func(OmegleConnection *omconn,
+		GDestroyNotify lost_func)
+{
+	omconn->lost_func = lost_func;
+}
+
+/**
+ * Mark a request that others can stand in for, such as one candidate of
+ * a hedged start.  If it can't reach its server the caller just gets an
+ * empty response; the account carries on as if nothing happened.
+ */
+void om_connection_set_expendable(OmegleConnection *omconn)
+{
+	omconn->expendable = TRUE;
+}
+
+static void om_connection_deliver(OmegleConnection *omconn, gchar *data,
+		gsize len, gpointer parsed)
+{
+	guint profile;
+
+	/* The caller is about to hear the outcome, and may well free
+	 * user_data on the strength of it */
+	omconn->lost_func = NULL;
+
+	if (omconn->parse_func != NULL) {
+		if (parsed == NULL) {
+			profile = om_profile_enter(OM_PHASE_PARSE, omconn->rate_class);
+			parsed = omconn->parse_func(data, len);
+			om_profile_leave(profile);
+		}
+		om_trace(omconn->id, OM_TRACE_DISPATCHED, len);
+		profile = om_profile_enter(OM_PHASE_DISPATCH, omconn->rate_class);
+		omconn->parsed_callback(omconn->oma, parsed, omconn->user_data);
+		omconn->parsed_free(parsed);
+		om_profile_leave(profile);
+	} else if (omconn->callback != NULL) {
+		om_trace(omconn->id, OM_TRACE_DISPATCHED, len);
+		profile = om_profile_enter(OM_PHASE_DISPATCH, omconn->rate_class);
+		omconn->callback(omconn->oma, data, len, omconn->user_data);
+		om_profile_leave(profile);
+	}
+}
+
+/*
+ * Decompressing and parsing can be handed to a worker thread.  The
+ * OmegleConnection stays around, without its socket, until the result
+ * comes back so that callers can still cancel it.
+ */
+
+static void om_connection_job_free(OmegleConnectionJob *job)
+{
+	om_memory_release(job->oma, job->charged);
+	if (job->parsed != NULL)
+		job->parsed_free(job->parsed);
+	g_free(job->headers);
+	g_free(job->data);
+	g_free(job);
+}
+
+/**
+ * Split a whole response into its headers and a copy of its body.
+ * The headers are terminated in place in raw, and *headers is left NULL
+ * if the end of them never arrived.  Safe to call from any thread.
+ */
+static gchar *om_connection_split(gchar *raw, gsize raw_len, gsize *len,
+		gchar **headers, gboolean *gzipped)
+{
+	gchar *end, *body;
+
+	*headers = NULL;
+	*gzipped = FALSE;
+
+	end = g_strstr_len(raw, raw_len, "\r\n\r\n");
+	if (end == NULL) {
+		/* This is a corner case that occurs when the connection is
+		 * prematurely closed either on the client or the server.
+		 * This can either be no data at all or a partial set of
+		 * headers.  We pass along the data to be good, but don't
+		 * do any fancy massaging.  In all likelihood the result will
+		 * be tossed by the connection callback func anyways
+		 */
+		*len = raw_len;
+		return g_strndup(raw, raw_len);
+	}
+
+	*len = raw_len - (end - raw + 4);
+	body = g_memdup(end + 4, *len + 1);
+	body[*len] = '\0';
+	end[4] = '\0';
+
+	*headers = raw;
+	*gzipped = (strstr(raw, "Content-Encoding: gzip") != NULL);
+
+	return body;
+}
+
+static void om_connection_job_work(gpointer data)
+{
+	OmegleConnectionJob *job = data;
+	guint profile;
+
+	if (job->raw) {
+		gchar *raw = job->data;
+		gchar *headers;
+
+		profile = om_profile_enter(OM_PHASE_RECEIVE, job->rate_class);
+		job->data = om_connection_split(raw, job->len, &job->len, &headers,
+				&job->gzipped);
+		job->headers = g_strdup(headers);
+		g_free(raw);
+		om_profile_leave(profile);
+		om_trace(job->conn_id, OM_TRACE_RESPONSE, job->len);
+	}
+
+	if (job->gzipped) {
+		gchar *gunzipped;
+		ssize_t len = job->len;
+
+		profile = om_profile_enter(OM_PHASE_GUNZIP, job->rate_class);
+		gunzipped = om_gunzip((const guchar *)job->data, &len,
+				job->max_inflated, &job->error);
+		g_free(job->data);
+		job->data = gunzipped;
+		job->len = len;
+		om_profile_leave(profile);
+		om_trace(job->conn_id, OM_TRACE_GUNZIPPED, len);
+	}
+
+	if (job->parse_func != NULL) {
+		profile = om_profile_enter(OM_PHASE_PARSE, job->rate_class);
+		job->parsed = job->parse_func(job->data, job->len);
+		om_profile_leave(profile);
+	}
+}
+
+static void om_connection_job_done(gpointer data)
+{
+	OmegleConnectionJob *job = data;
+	OmegleConnection *omconn = job->omconn;
+
+	if (job->cancelled) {
+		om_connection_job_free(job);
+		return;
+	}
+
+	omconn->job = NULL;
+	if (job->headers != NULL)
+		om_update_cookies(omconn->oma, job->headers);
+	if (job->error != NULL)
+		purple_debug_error("omegle", "%s\n", job->error);
+
+	om_connection_deliver(omconn, job->data, job->len, job->parsed);
+	job->parsed = NULL;
+
+	om_connection_destroy(omconn);
+	om_connection_job_free(job);
+}
+
+void om_connection_worker_init(OmegleAccount *oma)
+{
+	if (!purple_account_get_bool(oma->account, "worker_thread", FALSE))
+		return;
+
+	oma->worker = om_worker_new(om_connection_job_work,
+			om_connection_job_done, (GDestroyNotify)om_connection_job_free);
+}
+
+void om_connection_worker_destroy(OmegleAccount *oma)
+{
+	if (oma->worker == NULL)
+		return;
+
+	om_worker_destroy(oma->worker);
+	oma->worker = NULL;
+}
+
+/**
+ * Returns TRUE if the response was handed to the worker thread, in
+ * which case the connection must be kept until it comes back.
+ */
+static gboolean om_connection_process_data(OmegleConnection *omconn)
+{
+	gsize body_len;
+	ssize_t len;
+	gchar *tmp, *headers;
+	gboolean gzipped;
+	const gchar *error = NULL;
+	guint profile;
+
+	if (omconn->oma->worker != NULL) {
+		OmegleConnectionJob *job;
+
+		/* The whole response moves to the worker as it is, memory
+		 * charge and all, and is split up there */
+		job = g_new0(OmegleConnectionJob, 1);
+		job->omconn = omconn;
+		job->oma = omconn->oma;
+		job->conn_id = omconn->id;
+		job->data = omconn->rx_buf;
+		job->len = omconn->rx_len;
+		job->charged = omconn->rx_len;
+		job->raw = TRUE;
+		omconn->rx_buf = NULL;
+		omconn->rx_len = 0;
+		omconn->rx_size = 0;
+		job->max_inflated = om_connection_limit(omconn->oma,
+				"max_inflated_kb", OM_DEFAULT_MAX_INFLATED_KB);
+		job->parse_func = omconn->parse_func;
+		job->parsed_free = omconn->parsed_free;
+		job->rate_class = omconn->rate_class;
+		omconn->job = job;
+
+		om_connection_close_socket(omconn);
+		om_worker_push(omconn->oma->worker, job);
+		return TRUE;
+	}
+
+	profile = om_profile_enter(OM_PHASE_RECEIVE, omconn->rate_class);
+
+	tmp = om_connection_split(omconn->rx_buf, omconn->rx_len, &body_len,
+			&headers, &gzipped);
+	len = body_len;
+	if (headers != NULL)
+		om_update_cookies(omconn->oma, headers);
+
+	om_memory_release(omconn->oma, omconn->rx_len);
+	g_free(omconn->rx_buf);
+	omconn->rx_buf = NULL;
+	omconn->rx_size = 0;
+
+	om_profile_leave(profile);
+	om_trace(omconn->id, OM_TRACE_RESPONSE, len);
+
+	if (gzipped)
+	{
+		/* we've received compressed gzip data, decompress */
+		gchar *gunzipped;
+		profile = om_profile_enter(OM_PHASE_GUNZIP, omconn->rate_class);
+		gunzipped = om_gunzip((const guchar *)tmp, &len,
+				om_connection_limit(omconn->oma, "max_inflated_kb",
+					OM_DEFAULT_MAX_INFLATED_KB), &error);
+		g_free(tmp);
+		tmp = gunzipped;
+		om_profile_leave(profile);
+		om_trace(omconn->id, OM_TRACE_GUNZIPPED, len);
+		if (error != NULL)
+			purple_debug_error("omegle", "%s\n", error);
+	}
+
+	om_connection_deliver(omconn, tmp, len, NULL);
+
+	g_free(tmp);
+
+	return FALSE;
+}
+
+/**
+ * A request couldn't reach the server.  If the request is expendable,
+ * or the account is riding out a network outage, tell whoever made the
+ * request that it failed, as with an abort, and return TRUE.
+ */
+static gboolean om_connection_network_lost(OmegleConnection *omconn)
+{
+	if (omconn->request == NULL)
+		return FALSE;
+
+	/* Someone else is trying another server, so this says nothing
+	 * about the network */
+	if (!omconn->expendable && !om_sessions_network_lost(omconn->oma))
+		return FALSE;
+
+	om_connection_close_socket(omconn);
+	om_connection_deliver(omconn, NULL, 0, NULL);
+	om_connection_destroy(omconn);
+
+	return TRUE;
+}
+
+/******************************************************************************/
+/* Event streams */
+/******************************************************************************/
+
+/*
+ * A request made with OM_METHOD_STREAM asks for text/event-stream.  A
+ * server that can do it keeps the response open and sends each batch
+ * of events as a server-sent event, "data: [[...]]" then a blank line,
+ * possibly inside chunked encoding.  Each event is parsed and handed
+ * to the stream callback as soon as it is complete, and its bytes are
+ * dropped so the stream can stay open for as long as the server likes.
+ * When the stream ends the normal callback gets an empty response.
+ *
+ * A server that doesn't stream just answers as usual, so the ordinary
+ * long-poll is the fallback without anyone having to ask.
+ */
+
+/**
+ * Have events passed to stream_callback as they arrive, if the server
+ * streams them.  A NULL parsed means the stream has started; the
+ * callback must not cancel the connection then.
+ */
+void om_connection_set_stream(OmegleConnection *omconn,
+		OmegleParsedCallbackFunc stream_callback)
+{
+	omconn->stream_callback = stream_callback;
+}
+
+/** Check a callback didn't destroy omconn, without looking inside it */
+static gboolean om_connection_alive(OmegleAccount *oma,
+		OmegleConnection *omconn, guint32 id)
+{
+	return g_slist_find(oma->conns, omconn) != NULL && omconn->id == id;
+}
+
+/** Append, leaving out carriage returns so lines end with a bare \n */
+static void om_stream_append(GString *buf, const gchar *data, gsize len)
+{
+	const gchar *cr;
+
+	while ((cr = memchr(data, '\r', len)) != NULL)
+	{
+		g_string_append_len(buf, data, cr - data);
+		len -= cr - data + 1;
+		data = cr + 1;
+	}
+	g_string_append_len(buf, data, len);
+}
+
+/**
+ * Decode as much chunked encoding as has arrived into stream_buf.
+ * Returns how much of rx_buf was used, and sets done on the last chunk.
+ */
+static gsize om_connection_dechunk(OmegleConnection *omconn, gboolean *done)
+{
+	const gchar *buf = omconn->rx_buf;
+	const gchar *line_end;
+	gsize pos = 0, n;
+
+	while (pos < omconn->rx_len)
+	{
+		if (omconn->chunk_left > 0)
+		{
+			n = MIN(omconn->chunk_left, omconn->rx_len - pos);
+			om_stream_append(omconn->stream_buf, buf + pos, n);
+			pos += n;
+			omconn->chunk_left -= n;
+			if (omconn->chunk_left == 0)
+				omconn->chunk_crlf = TRUE;
+			continue;
+		}
+
+		line_end = memchr(buf + pos, '\n', omconn->rx_len - pos);
+		if (line_end == NULL)
+			break;
+
+		if (omconn->chunk_crlf)
+		{
+			omconn->chunk_crlf = FALSE;
+		} else {
+			omconn->chunk_left = g_ascii_strtoull(buf + pos, NULL, 16);
+			if (omconn->chunk_left == 0)
+			{
+				/* Any trailers after this are of no interest */
+				*done = TRUE;
+				return line_end - buf + 1;
+			}
+		}
+		pos = line_end - buf + 1;
+	}
+
+	return pos;
+}
+
+/** The data lines of one server-sent event, or NULL if it has none */
+static gchar *om_stream_event_data(const gchar *event, const gchar *end)
+{
+	GString *data = NULL;
+	const gchar *line, *line_end;
+
+	for (line = event; line < end; line = line_end + 1)
+	{
+		line_end = memchr(line, '\n', end - line);
+		if (line_end == NULL)
+			line_end = end;
+		if (line_end - line < 5 || strncmp(line, "data:", 5) != 0)
+			continue;
+
+		line += 5;
+		if (line < line_end && *line == ' ')
+			line++;
+		if (data == NULL)
+			data = g_string_new(NULL);
+		else
+			g_string_append_c(data, '\n');
+		g_string_append_len(data, line, line_end - line);
+	}
+
+	return data ? g_string_free(data, FALSE) : NULL;
+}
+
+static void om_connection_stream_end(OmegleConnection *omconn)
+{
+	om_connection_close_socket(omconn);
+	om_connection_deliver(omconn, NULL, 0, NULL);
+	om_connection_destroy(omconn);
+}
+
+/**
+ * Hand over every complete event.  Returns FALSE if the connection
+ * went away in the process.
+ */
+static gboolean om_connection_stream_dispatch(OmegleConnection *omconn)
+{
+	OmegleAccount *oma = omconn->oma;
+	guint32 id = omconn->id;
+	GDestroyNotify parsed_free = omconn->parsed_free;
+	gchar *end, *data;
+	gsize event_len;
+	gpointer parsed;
+
+	while ((end = strstr(omconn->stream_buf->str, "\n\n")) != NULL)
+	{
+		data = om_stream_event_data(omconn->stream_buf->str, end);
+		event_len = end - omconn->stream_buf->str + 2;
+		g_string_erase(omconn->stream_buf, 0, event_len);
+		om_memory_release(oma, event_len);
+
+		/* Comments and keepalives have no data */
+		if (data == NULL)
+			continue;
+
+		om_trace(id, OM_TRACE_DISPATCHED, strlen(data));
+		parsed = omconn->parse_func(data, strlen(data));
+		g_free(data);
+		omconn->stream_callback(oma, parsed, omconn->user_data);
+		parsed_free(parsed);
+
+		if (!om_connection_alive(oma, omconn, id))
+			return FALSE;
+	}
+
+	return TRUE;
+}
+
+/**
+ * Move newly read body bytes out of rx_buf and dispatch what they
+ * complete.  Returns FALSE if the connection is finished with.
+ */
+static gboolean om_connection_stream_read(OmegleConnection *omconn)
+{
+	OmegleAccount *oma = omconn->oma;
+	gsize used, before;
+	gboolean done = FALSE;
+
+	before = omconn->stream_buf->len;
+	if (omconn->stream_chunked) {
+		used = om_connection_dechunk(omconn, &done);
+	} else {
+		om_stream_append(omconn->stream_buf, omconn->rx_buf, omconn->rx_len);
+		used = omconn->rx_len;
+	}
+
+	memmove(omconn->rx_buf, omconn->rx_buf + used,
+			omconn->rx_len - used + 1);
+	omconn->rx_len -= used;
+	om_memory_release(oma, used);
+	om_memory_charge(oma, omconn->stream_buf->len - before);
+
+	if (!om_connection_stream_dispatch(omconn))
+		return FALSE;
+
+	if (done)
+	{
+		om_connection_stream_end(omconn);
+		return FALSE;
+	}
+
+	if (omconn->rx_len + omconn->stream_buf->len > om_connection_limit(oma,
+			"max_body_kb", OM_DEFAULT_MAX_BODY_KB))
+	{
+		om_connection_abort(omconn, "streamed event too large");
+		return FALSE;
+	}
+
+	return TRUE;
+}
+
+/**
+ * Once the headers are in, see whether the response is a stream.  If
+ * so the headers are dealt with and dropped from rx_buf.
+ */
+static gboolean om_connection_stream_start(OmegleConnection *omconn)
+{
+	OmegleAccount *oma = omconn->oma;
+	gchar *headers;
+
+	headers = g_strndup(omconn->rx_buf, omconn->header_len);
+	if (purple_strcasestr(headers, "\r\nContent-Type: text/event-stream") == NULL)
+	{
+		/* An ordinary response, stop looking */
+		g_free(headers);
+		omconn->stream_callback = NULL;
+		return FALSE;
+	}
+
+	omconn->streaming = TRUE;
+	omconn->stream_chunked = (purple_strcasestr(headers,
+			"\r\nTransfer-Encoding: chunked") != NULL);
+	om_update_cookies(oma, headers);
+	g_free(headers);
+	om_trace(omconn->id, OM_TRACE_STREAMING, omconn->header_len);
+
+	memmove(omconn->rx_buf, omconn->rx_buf + omconn->header_len,
+			omconn->rx_len - omconn->header_len + 1);
+	omconn->rx_len -= omconn->header_len;
+	om_memory_release(oma, omconn->header_len);
+	omconn->stream_buf = g_string_sized_new(256);
+
+	omconn->stream_callback(oma, NULL, omconn->user_data);
+
+	return TRUE;
+}
+
+static void om_fatal_connection_cb(OmegleConnection *omconn)
+{
+	PurpleConnection *pc = omconn->oma->pc;
+
+	om_trace(omconn->id, OM_TRACE_FAILED, 0);
+	if (om_connection_network_lost(omconn))
+		return;
+	if (omconn->oma->closing)
+	{
+		/* Nobody left to tell */
+		om_connection_destroy(omconn);
+		return;
+	}
+
+	purple_debug_error("omegle", "fatal connection error\n");
+	om_trace_dump_to_debug();
+
+	om_connection_destroy(omconn);
+
+	/* We died.  Do not pass Go.  Do not collect $200 */
+	/* In all seriousness, don't attempt to call the normal callback here.
+	 * That may lead to the wrong error message being displayed */
+	purple_connection_error_reason(pc,
+				PURPLE_CONNECTION_ERROR_NETWORK_ERROR,
+				_("Server closed the connection."));
+
+}
+
+/**
+ * Read whatever fits straight onto the end of rx_buf, growing it by
+ * doubling when it gets short of room.  rx_buf is always kept nul
+ * terminated.
+ */
+static ssize_t om_connection_read(OmegleConnection *omconn)
+{
+	ssize_t len;
+	gsize room;
+
+	if (omconn->rx_size - omconn->rx_len < OM_READ_MIN_ROOM)
+	{
+		omconn->rx_size = MAX(omconn->rx_size * 2, OM_READ_INITIAL_SIZE);
+		omconn->rx_buf = g_realloc(omconn->rx_buf, omconn->rx_size);
+	}
+	/* Leave space for the nul */
+	room = omconn->rx_size - omconn->rx_len - 1;
+
+	if (omconn->method & OM_METHOD_SSL) {
+		len = purple_ssl_read(omconn->ssl_conn,
+				omconn->rx_buf + omconn->rx_len, room);
+	} else {
+		len = recv(omconn->fd, omconn->rx_buf + omconn->rx_len, room, 0);
+	}
+
+	if (len > 0)
+		omconn->rx_len += len;
+	omconn->rx_buf[omconn->rx_len] = '\0';
+
+	return len;
+}
+
+/**
+ * Send a request again on a fresh connection after the reused one it
+ * went out on turned out to be closed.  This only happens once, as a
+ * new connection isn't reused.
+ */
+static void om_connection_retry(OmegleConnection *omconn)
+{
+	purple_debug_info("omegle", "kept connection to %s was closed, "
+			"sending %s again\n", omconn->origin_host, omconn->url);
+	om_trace(omconn->id, OM_TRACE_FAILED, 0);
+	omconn->oma->stats.stale_retries++;
+
+	om_connection_close_socket(omconn);
+	omconn->reused = FALSE;
+	om_attempt_connection(omconn);
+}
+
+static void om_post_or_get_readdata_cb(gpointer data, gint source,
+		PurpleInputCondition cond)
+{
+	OmegleConnection *omconn;
+	ssize_t len;
+	gsize prev_len;
+	const gchar *too_large;
+	guint profile;
+
+	omconn = data;
+
+	/*
+	 * Keep reading until the socket has nothing more for us.  One read
+	 * per wakeup costs a trip around the main loop for every few KB,
+	 * and the SSL layer may be holding decrypted data that will never
+	 * make the socket readable again.
+	 */
+	for (;;)
+	{
+		prev_len = omconn->rx_len;
+
+		profile = om_profile_enter(OM_PHASE_RECEIVE, omconn->rate_class);
+		len = om_connection_read(omconn);
+		om_profile_leave(profile);
+		if (len <= 0)
+			break;
+
+		om_memory_charge(omconn->oma, len);
+		om_trace(omconn->id, OM_TRACE_RECEIVED, len);
+		omconn->oma->timeouts_in_row = 0;
+		if (omconn->timeout_timer > 0)
+			om_connection_set_deadline(omconn);
+
+		if (omconn->streaming)
+		{
+			if (!om_connection_stream_read(omconn))
+				return;
+			continue;
+		}
+
+		too_large = om_connection_check_limits(omconn, prev_len);
+		if (too_large != NULL)
+		{
+			om_connection_abort(omconn, too_large);
+			return;
+		}
+
+		if (omconn->stream_callback != NULL && omconn->header_len > 0 &&
+				om_connection_stream_start(omconn) &&
+				!om_connection_stream_read(omconn))
+			return;
+
+		if (omconn->request != NULL && !omconn->streaming &&
+				omconn->has_content_length && omconn->header_len > 0 &&
+				omconn->rx_len - omconn->header_len >= omconn->content_length)
+		{
+			/* All here, no need to wait for the server to hang up */
+			om_connection_response_done(omconn);
+			return;
+		}
+	}
+
+	if (len < 0 &&
+		(errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR))
+	{
+		/* Try again later */
+		return;
+	}
+
+	if (omconn->reused && omconn->request != NULL && omconn->rx_len == 0)
+	{
+		/* The server gave up on the idle socket before our request got
+		 * there.  That says nothing about the network. */
+		om_connection_retry(omconn);
+		return;
+	}
+
+	if (len < 0)
+	{
+		if (omconn->streaming) {
+			/* Streams get cut off now and then, start another */
+			om_connection_stream_end(omconn);
+			return;
+		}
+
+		if (omconn->request == NULL) {
+			/* A pre-warmed connection went away before we used it */
+			om_connection_destroy(omconn);
+			return;
+		}
+
+		if (omconn->method & OM_METHOD_SSL && omconn->rx_len > 0) {
+			/*
+			 * This is a slightly hacky workaround for a bug in either
+			 * GNU TLS or in the SSL implementation on Omegle's web
+			 * servers.  The sequence of events is:
+			 * 1. We attempt to read the first time and successfully read
+			 *    the server's response.
+			 * 2. We attempt to read a second time and libpurple's call
+			 *    to gnutls_record_recv() returns the error
+			 *    GNUTLS_E_UNEXPECTED_PACKET_LENGTH, or
+			 *    "A TLS packet with unexpected length was received."
+			 *
+			 * Normally the server would have closed the connection
+			 * cleanly and this second read() request would have returned
+			 * 0.  Or maybe it's normal for SSL connections to be severed
+			 * in this manner?  In any case, this differs from the behavior
+			 * of the standard recv() system call.
+			 */
+			purple_debug_warning("omegle",
+				"ssl error, but data received.  attempting to continue\n");
+		} else {
+			/* TODO: Is this a regular occurrence?  If so then maybe resend the request? */
+			om_fatal_connection_cb(omconn);
+			return;
+		}
+	}
+
+	if (omconn->streaming)
+	{
+		om_connection_stream_end(omconn);
+		return;
+	}
+
+	/* The server closed the connection, let's parse the data */
+	if (omconn->request != NULL && om_connection_process_data(omconn))
+		return;
+
+	om_connection_destroy(omconn);
+}
+
+static void om_post_or_get_ssl_readdata_cb (gpointer data,
+		PurpleSslConnection *ssl, PurpleInputCondition cond)
+{
+	om_post_or_get_readdata_cb(data, -1, cond);
+}
+
+/**
+ * Point the read callbacks of a socket that changed hands at its new
+ * owner.
+ */
+static void om_connection_watch(OmegleConnection *omconn)
+{
+	if (omconn->ssl_conn != NULL) {
+		/* purple_ssl_input_add doesn't drop the watch it already has */
+		if (omconn->ssl_conn->inpa > 0)
+			purple_input_remove(omconn->ssl_conn->inpa);
+		purple_ssl_input_add(omconn->ssl_conn,
+				om_post_or_get_ssl_readdata_cb, omconn);
+	} else {
+		omconn->input_watcher = purple_input_add(omconn->fd,
+				PURPLE_INPUT_READ, om_post_or_get_readdata_cb, omconn);
+	}
+}
+
+/**
+ * Hand a kept-alive socket over to a new idle connection in the shared
+ * pool, so the next request to the server skips the connect and any
+ * TLS handshake.  omconn is left without a socket.
+ */
+static void om_connection_recycle(OmegleConnection *omconn)
+{
+	OmegleAccount *oma = omconn->oma;
+	OmegleConnection *idle;
+	GSList *pooled;
+	gchar *key;
+
+	if (oma->closing || oma->account->disconnecting)
+		return;
+
+	key = om_connection_pool_key(oma, omconn->origin_host, omconn->method);
+	pooled = g_hash_table_lookup(om_warm_pool, key);
+	if (g_slist_length(pooled) >= OM_MAX_WARM_CONNS)
+	{
+		g_free(key);
+		return;
+	}
+
+	if (omconn->input_watcher > 0)
+		purple_input_remove(omconn->input_watcher);
+	omconn->input_watcher = 0;
+
+	idle = g_new0(OmegleConnection, 1);
+	idle->oma = oma;
+	idle->id = om_trace_connection_id();
+	idle->method = omconn->method & ~OM_METHOD_STREAM;
+	idle->hostname = g_strdup(omconn->hostname);
+	idle->origin_host = g_strdup(omconn->origin_host);
+	idle->fd = omconn->fd;
+	idle->ssl_conn = omconn->ssl_conn;
+	/* Servers time out idle connections, so its age starts now */
+	idle->connect_time = g_get_monotonic_time();
+	idle->pool_key = key;
+	omconn->fd = -1;
+	omconn->ssl_conn = NULL;
+
+	oma->conns = g_slist_prepend(oma->conns, idle);
+	g_hash_table_insert(om_warm_pool, g_strdup(key),
+			g_slist_prepend(pooled, idle));
+	oma->stats.conns_recycled++;
+
+	/* Still watched, to notice the server hanging up */
+	om_connection_watch(idle);
+}
+
+/**
+ * The whole body, going by Content-Length, has arrived.  The socket is
+ * recycled if both ends agreed to keep it alive and nothing unexpected
+ * came after the body; otherwise it is closed as usual.
+ */
+static void om_connection_response_done(OmegleConnection *omconn)
+{
+	if (omconn->connection_keepalive && omconn->server_keepalive &&
+			omconn->rx_len - omconn->header_len == omconn->content_length)
+		om_connection_recycle(omconn);
+
+	if (om_connection_process_data(omconn))
+		return;
+
+	om_connection_destroy(omconn);
+}
+
+static void om_connection_send_request(OmegleConnection *omconn)
+{
+	ssize_t len;
+
+	om_trace(omconn->id, OM_TRACE_REQUEST, omconn->request->len);
+
+	/* TODO: Check the return value of write() */
+	if (omconn->method & OM_METHOD_SSL) {
+		len = purple_ssl_write(omconn->ssl_conn,
+				omconn->request->str, omconn->request->len);
+	} else {
+		len = write(omconn->fd, omconn->request->str,
+				omconn->request->len);
+	}
+}
+
+/**
+ * Record how long the connect phase took.  Pre-warmed connections are
+ * counted separately since nobody was waiting on them.
+ */
+static void om_connection_connected(OmegleConnection *omconn)
+{
+	OmegleAccount *oma = omconn->oma;
+
+	omconn->connect_time = g_get_monotonic_time();
+	om_trace(omconn->id, OM_TRACE_CONNECTED,
+			omconn->connect_time - omconn->connect_start);
+
+	if (omconn->request == NULL) {
+		oma->stats.warm_connects++;
+		oma->stats.warm_connect_usec +=
+				omconn->connect_time - omconn->connect_start;
+	} else {
+		oma->stats.cold_connects++;
+		oma->stats.cold_connect_usec +=
+				omconn->connect_time - omconn->connect_start;
+	}
+}
+
+static void om_post_or_get_connect_cb(gpointer data, gint source,
+		const gchar *error_message)
+{
+	OmegleConnection *omconn;
+
+	omconn = data;
+	omconn->connect_data = NULL;
+
+	if (error_message)
+	{
+		purple_debug_error("omegle", "post_or_get_connect failure to %s\n",
+				omconn->url ? omconn->url : omconn->hostname);
+		purple_debug_error("omegle", "post_or_get_connect_cb %s\n",
+				error_message);
+		if (omconn->request == NULL) {
+			/* Only a pre-warmed connection, nobody is relying on it */
+			om_connection_destroy(omconn);
+			return;
+		}
+		om_fatal_connection_cb(omconn);
+		return;
+	}
+
+	omconn->fd = source;
+	om_connection_connected(omconn);
+
+	/* Pre-warmed connections still watch for the server hanging up */
+	if (omconn->request != NULL)
+		om_connection_send_request(omconn);
+	omconn->input_watcher = purple_input_add(omconn->fd,
+			PURPLE_INPUT_READ,
+			om_post_or_get_readdata_cb, omconn);
+}
+
+static void om_post_or_get_ssl_connect_cb(gpointer data,
+		PurpleSslConnection *ssl, PurpleInputCondition cond)
+{
+	OmegleConnection *omconn;
+
+	omconn = data;
+
+	om_connection_connected(omconn);
+
+	if (omconn->request != NULL)
+		om_connection_send_request(omconn);
+	purple_ssl_input_add(omconn->ssl_conn,
+			om_post_or_get_ssl_readdata_cb, omconn);
+}
+
+static void om_host_lookup_cb(GSList *hosts, gpointer data,
+		const char *error_message)
+{
+	struct sockaddr_in *addr;
+	gchar *hostname = data;
+	OmegleDnsEntry *entry;
+
+	/* The callback has executed, so we no longer need to keep track of
+	 * the original query.  This always needs to run when the cb is 
+	 * executed. */
+	g_hash_table_remove(om_dns_queries, hostname);
+
+	/* Any problems, capt'n? */
+	if (error_message != NULL)
+	{
+		purple_debug_warning("omegle",
+				"Error doing host lookup: %s\n", error_message);
+		g_free(hostname);
+		return;
+	}
+
+	if (hosts == NULL)
+	{
+		purple_debug_warning("omegle",
+				"Could not resolve host name\n");
+		g_free(hostname);
+		return;
+	}
+
+	entry = g_new0(OmegleDnsEntry, 1);
+
+	/* Discard the length... */
+	hosts = g_slist_delete_link(hosts, hosts);
+	/* Copy the address then free it... */
+	addr = hosts->data;
+	entry->ip = g_strdup(inet_ntoa(addr->sin_addr));
+	g_free(addr);
+	hosts = g_slist_delete_link(hosts, hosts);
+
+	/*
+	 * DNS lookups can return a list of IP addresses, but we only cache
+	 * the first one.  So free the rest.
+	 */
+	while (hosts != NULL)
+	{
+		/* Discard the length... */
+		hosts = g_slist_delete_link(hosts, hosts);
+		/* Free the address... */
+		g_free(hosts->data);
+		hosts = g_slist_delete_link(hosts, hosts);
+	}
+
+	entry->expires = g_get_monotonic_time() +
+			(gint64)OM_DNS_CACHE_TTL * G_USEC_PER_SEC;
+	g_hash_table_insert(om_dns_cache, hostname, entry);
+}
+
+static void om_cookie_foreach_cb(gchar *cookie_name,
+		gchar *cookie_value, GString *str)
+{
+	/* TODO: Need to escape name and value? */
+	g_string_append_printf(str, "%s=%s;", cookie_name, cookie_value);
+}
+
+/**
+ * Serialize the oma->cookie_table hash table to a string.
+ */
+static gchar *om_cookies_to_string(OmegleAccount *oma)
+{
+	GString *str;
+
+	str = g_string_new(NULL);
+
+	g_hash_table_foreach(oma->cookie_table,
+			(GHFunc)om_cookie_foreach_cb, str);
+
+	return g_string_free(str, FALSE);
+}
+
+static void om_ssl_connection_error(PurpleSslConnection *ssl,
+		PurpleSslErrorType errortype, gpointer data)
+{
+	OmegleConnection *omconn = data;
+	PurpleConnection *pc = omconn->oma->pc;
+	gboolean warm = (omconn->request == NULL);
+
+	omconn->ssl_conn = NULL;
+	if ((errortype == PURPLE_SSL_CONNECT_FAILED || omconn->expendable) &&
+			om_connection_network_lost(omconn))
+		return;
+
+	om_connection_destroy(omconn);
+	if (!warm && pc != NULL)
+		purple_connection_ssl_error(pc, errortype);
+}
+
+/**
+ * Look up the cached IP address for a host.  If there isn't one, or it
+ * is getting old, start a DNS lookup so that the next request can use
+ * a fresh one.  The cache is shared by every account, and so is the
+ * lookup for any one host.
+ */
+static const gchar *om_host_lookup(OmegleAccount *oma, const gchar *host)
+{
+	OmegleDnsEntry *entry;
+	PurpleDnsQueryData *query;
+	gchar *hostname;
+
+	entry = g_hash_table_lookup(om_dns_cache, host);
+	if (entry != NULL && entry->expires > g_get_monotonic_time())
+		return entry->ip;
+
+	/* An old address is still better than none while we refresh it */
+	if (g_hash_table_lookup(om_dns_queries, host) == NULL &&
+		oma->account && !oma->account->disconnecting)
+	{
+		hostname = g_strdup(host);
+		query = purple_dnsquery_a(hostname, 80,
+				om_host_lookup_cb, hostname);
+		if (query != NULL)
+			g_hash_table_insert(om_dns_queries, hostname, query);
+	}
+
+	return entry ? entry->ip : NULL;
+}
+
+static PurpleProxyInfo *om_connection_proxy_info(OmegleAccount *oma)
+{
+	PurpleProxyInfo *proxy_info;
+
+	proxy_info = purple_proxy_get_setup(oma->account);
+	if (purple_proxy_info_get_type(proxy_info) == PURPLE_PROXY_USE_GLOBAL)
+		proxy_info = purple_global_proxy_get_info();
+
+	return proxy_info;
+}
+
+/**
+ * Connections can only be handed between accounts if they go to the
+ * same place the same way, so the proxy is part of the key.
+ */
+static gchar *om_connection_pool_key(OmegleAccount *oma, const gchar *host,
+		OmegleMethod method)
+{
+	PurpleProxyInfo *proxy_info;
+	gboolean ssl = (method & OM_METHOD_SSL) != 0;
+
+	proxy_info = om_connection_proxy_info(oma);
+
+	if (proxy_info == NULL ||
+		purple_proxy_info_get_type(proxy_info) == PURPLE_PROXY_NONE)
+		return g_strdup_printf("%s:%d:%s", host, ssl ? 443 : 80,
+				ssl ? "tls" : "tcp");
+
+	/* Plain requests through an HTTP proxy name the server in the
+	 * request line, so a connection to the proxy will do for any of
+	 * them.  TLS goes through a CONNECT tunnel to one server. */
+	if (!ssl && purple_proxy_info_get_type(proxy_info) == PURPLE_PROXY_HTTP)
+		return g_strdup_printf("http proxy %s@%s:%d",
+				purple_proxy_info_get_username(proxy_info) ?
+					purple_proxy_info_get_username(proxy_info) : "",
+				purple_proxy_info_get_host(proxy_info) ?
+					purple_proxy_info_get_host(proxy_info) : "",
+				purple_proxy_info_get_port(proxy_info));
+
+	return g_strdup_printf("%s:%d:%s via %d:%s@%s:%d", host,
+			ssl ? 443 : 80, ssl ? "tls" : "tcp",
+			purple_proxy_info_get_type(proxy_info),
+			purple_proxy_info_get_username(proxy_info) ?
+				purple_proxy_info_get_username(proxy_info) : "",
+			purple_proxy_info_get_host(proxy_info) ?
+				purple_proxy_info_get_host(proxy_info) : "",
+			purple_proxy_info_get_port(proxy_info));
+}
+
+static void om_connection_pool_remove(OmegleConnection *omconn)
+{
+	GSList *idle;
+
+	if (omconn->pool_key == NULL)
+		return;
+
+	idle = g_hash_table_lookup(om_warm_pool, omconn->pool_key);
+	idle = g_slist_remove(idle, omconn);
+	if (idle != NULL)
+		g_hash_table_insert(om_warm_pool, g_strdup(omconn->pool_key), idle);
+	else
+		g_hash_table_remove(om_warm_pool, omconn->pool_key);
+
+	g_free(omconn->pool_key);
+	omconn->pool_key = NULL;
+}
+
+/**
+ * Find a connected, unused pre-warmed connection to the given host.  It
+ * may have been opened by another account, in which case it changes
+ * hands.
+ */
+static OmegleConnection *om_connection_take_warm(OmegleAccount *oma,
+		const gchar *host, OmegleMethod method, OmegleRateClass rate_class)
+{
+	OmegleConnection *omconn = NULL, *idle;
+	gchar *key;
+	GSList *l, *expired = NULL;
+	guint ready = 0;
+	gint64 now = g_get_monotonic_time();
+
+	key = om_connection_pool_key(oma, host, method);
+	for (l = g_hash_table_lookup(om_warm_pool, key); l; l = l->next)
+	{
+		idle = l->data;
+		if (idle->connect_time == 0)
+			continue;
+		/* The prewarm check only comes round every so often */
+		if (now - idle->connect_time > OM_WARM_CONN_MAX_AGE * G_USEC_PER_SEC)
+		{
+			expired = g_slist_prepend(expired, idle);
+			continue;
+		}
+		if (omconn == NULL)
+			omconn = idle;
+		ready++;
+	}
+	g_free(key);
+
+	for (l = expired; l; l = l->next)
+	{
+		idle = l->data;
+		idle->oma->stats.warm_expired++;
+		om_connection_destroy(idle);
+	}
+	g_slist_free(expired);
+
+	if (omconn == NULL)
+		return NULL;
+
+	/* A poll would sit on the connection for a long time, so the last
+	 * one is kept for /send and the like, which somebody is waiting on */
+	if (rate_class == OM_RATE_EVENTS && ready < 2)
+		return NULL;
+
+	om_connection_pool_remove(omconn);
+	if (omconn->oma != oma)
+	{
+		if (omconn->rx_buf != NULL)
+		{
+			om_memory_release(omconn->oma, omconn->rx_len);
+			om_memory_charge(oma, omconn->rx_len);
+		}
+		omconn->oma->conns = g_slist_remove(omconn->oma->conns, omconn);
+		omconn->oma = oma;
+		oma->conns = g_slist_prepend(oma->conns, omconn);
+	}
+
+	return omconn;
+}
+
+/**
+ * Start a request that was held back by the rate limiter.  The caller
+ * already has omconn, so rather than handing over a pooled connection
+ * as om_post_or_get does, its socket is moved into omconn.  Only if the
+ * pool has nothing is a new connection opened.
+ */
+static void om_connection_start_deferred(OmegleConnection *omconn)
+{
+	OmegleConnection *idle;
+
+	idle = om_connection_take_warm(omconn->oma, omconn->origin_host,
+			omconn->method, omconn->rate_class);
+	if (idle == NULL)
+	{
+		om_attempt_connection(omconn);
+		return;
+	}
+
+	if (idle->input_watcher > 0)
+		purple_input_remove(idle->input_watcher);
+	idle->input_watcher = 0;
+	omconn->fd = idle->fd;
+	omconn->ssl_conn = idle->ssl_conn;
+	idle->fd = -1;
+	idle->ssl_conn = NULL;
+	g_free(omconn->hostname);
+	omconn->hostname = g_strdup(idle->hostname);
+	omconn->connect_time = idle->connect_time;
+	om_connection_destroy(idle);
+
+	omconn->reused = TRUE;
+	omconn->oma->stats.warm_hits++;
+	om_connection_watch(omconn);
+	om_connection_set_deadline(omconn);
+	om_connection_send_request(omconn);
+}
+
+void om_connection_prewarm(OmegleAccount *oma, const gchar *host,
+		OmegleMethod method)
+{
+	OmegleConnection *omconn;
+	const gchar *host_ip;
+	GSList *l, *expired;
+	gint wanted, have;
+	gchar *key;
+
+	if (purple_account_get_bool(oma->account, "use_https", FALSE))
+		method |= OM_METHOD_SSL;
+
+	wanted = purple_account_get_int(oma->account, "warm_connections", 1);
+	if (wanted > OM_MAX_WARM_CONNS)
+		wanted = OM_MAX_WARM_CONNS;
+	if (wanted <= 0 || oma->account->disconnecting)
+		return;
+
+	key = om_connection_pool_key(oma, host, method);
+
+	/* Servers drop idle connections after a while, so replace ours
+	 * before that happens rather than finding out when we need one.
+	 * Whichever account opened them, they count towards what we want. */
+	have = 0;
+	expired = NULL;
+	for (l = g_hash_table_lookup(om_warm_pool, key); l; l = l->next)
+	{
+		omconn = l->data;
+		if (omconn->connect_time != 0 &&
+			g_get_monotonic_time() - omconn->connect_time >
+					OM_WARM_CONN_MAX_AGE * G_USEC_PER_SEC)
+		{
+			expired = g_slist_prepend(expired, omconn);
+		} else {
+			have++;
+		}
+	}
+	for (l = expired; l; l = l->next)
+	{
+		omconn = l->data;
+		omconn->oma->stats.warm_expired++;
+		om_connection_destroy(omconn);
+	}
+	g_slist_free(expired);
+
+	/* TLS has to connect by name, see om_post_or_get */
+	host_ip = (method & OM_METHOD_SSL) ? NULL : om_host_lookup(oma, host);
+
+	for (; have < wanted; have++)
+	{
+		omconn = g_new0(OmegleConnection, 1);
+		omconn->oma = oma;
+		omconn->id = om_trace_connection_id();
+		omconn->method = method;
+		omconn->hostname = g_strdup(host_ip ? host_ip : host);
+		omconn->origin_host = g_strdup(host);
+		omconn->fd = -1;
+		omconn->pool_key = g_strdup(key);
+		oma->conns = g_slist_prepend(oma->conns, omconn);
+		g_hash_table_insert(om_warm_pool, g_strdup(key),
+				g_slist_prepend(g_hash_table_lookup(om_warm_pool, key),
+					omconn));
+
+		om_attempt_connection(omconn);
+	}
+
+	g_free(key);
+}
+
+/**
+ * Call func for every address in the cache that is still fresh.  expires
+ * is in monotonic usec.
+ */
+void om_dns_cache_foreach(OmegleDnsFunc func, gpointer data)
+{
+	GHashTableIter iter;
+	const gchar *host;
+	OmegleDnsEntry *entry;
+	gint64 now = g_get_monotonic_time();
+
+	g_hash_table_iter_init(&iter, om_dns_cache);
+	while (g_hash_table_iter_next(&iter, (gpointer *)&host, (gpointer *)&entry))
+		if (entry->expires > now)
+			func(host, entry->ip, entry->expires, data);
+}
+
+/**
+ * Put an address remembered from an earlier run back in the cache,
+ * unless a lookup has already found a fresher one.
+ */
+gboolean om_dns_cache_restore(const gchar *host, const gchar *ip,
+		gint64 expires)
+{
+	OmegleDnsEntry *entry;
 
-	if (omconn->ssl_conn != NULL)
-		purple_ssl_close(omconn->ssl_conn);
+	entry = g_hash_table_lookup(om_dns_cache, host);
+	if (entry != NULL && entry->expires >= expires)
+		return FALSE;
 
-	if (omconn->fd >= 0) {
-		close(omconn->fd);
-	}
+	entry = g_new0(OmegleDnsEntry, 1);
+	entry->ip = g_strdup(ip);
+	entry->expires = expires;
+	g_hash_table_replace(om_dns_cache, g_strdup(host), entry);
 
-	if (omconn->input_watcher > 0)
-		purple_input_remove(omconn->input_watcher);
+	return TRUE;
+}
 
-	g_free(omconn->url);
-	g_free(omconn->hostname);
-	g_free(omconn);
+static void om_dns_query_cancel(gchar *hostname, PurpleDnsQueryData *query,
+		gpointer data)
+{
+	purple_dnsquery_destroy(query);
+	g_free(hostname);
 }
 
-static void om_update_cookies(OmegleAccount *oma, const gchar *headers)
+static void om_connection_quitting_cb(void *data);
+
+void om_connection_pool_init(void)
 {
-	const gchar *cookie_start;
-	const gchar *cookie_end;
-	gchar *cookie_name;
-	gchar *cookie_value;
-	int header_len;
+	om_dns_cache = g_hash_table_new_full(g_str_hash, g_str_equal,
+			g_free, (GDestroyNotify)om_dns_entry_free);
+	om_dns_queries = g_hash_table_new(g_str_hash, g_str_equal);
+	om_warm_pool = g_hash_table_new_full(g_str_hash, g_str_equal,
+			g_free, NULL);
+
+	purple_signal_connect(purple_get_core(), "quitting", &om_warm_pool,
+			PURPLE_CALLBACK(om_connection_quitting_cb), NULL);
+}
 
-	g_return_if_fail(headers != NULL);
+/**
+ * Called once every account has gone, so nothing is left in the pool
+ * but lookups may still be running.
+ */
+void om_connection_pool_destroy(void)
+{
+	purple_signals_disconnect_by_handle(&om_warm_pool);
+
+	/* Closing accounts hold connections that are in the pool tables */
+	om_connection_quitting_cb(NULL);
+
+	g_hash_table_foreach(om_dns_queries, (GHFunc)om_dns_query_cancel, NULL);
+	g_hash_table_destroy(om_dns_queries);
+	om_dns_queries = NULL;
+	g_hash_table_destroy(om_dns_cache);
+	om_dns_cache = NULL;
+	g_hash_table_destroy(om_warm_pool);
+	om_warm_pool = NULL;
+}
 
-	header_len = strlen(headers);
+/******************************************************************************/
+/* Shutdown */
+/******************************************************************************/
 
-	/* look for the next "Set-Cookie: " */
-	/* grab the data up until ';' */
-	cookie_start = headers;
-	while ((cookie_start = strstr(cookie_start, "\r\nSet-Cookie: ")) &&
-			(cookie_start - headers) < header_len)
-	{
-		cookie_start += 14;
-		cookie_end = strchr(cookie_start, '=');
-		cookie_name = g_strndup(cookie_start, cookie_end-cookie_start);
-		cookie_start = cookie_end + 1;
-		cookie_end = strchr(cookie_start, ';');
-		cookie_value= g_strndup(cookie_start, cookie_end-cookie_start);
-		cookie_start = cookie_end;
+/*
+ * When an account closes, requests that only tell the server something
+ * (/disconnect, /send and the like) are let finish instead of being cut
+ * off, all at once and without the rate limiter.  The OmegleAccount
+ * outlives its PurpleConnection until the last of them is done or
+ * OM_CLOSE_TIMEOUT runs out.  When libpurple is quitting there is no
+ * main loop left to finish them, so they are dropped.
+ */
 
-		g_hash_table_replace(oma->cookie_table, cookie_name,
-				cookie_value);
-	}
-}
+static GSList *om_closing_accounts;
+static gboolean om_quitting;
 
-static void om_connection_process_data(OmegleConnection *omconn)
+static void om_connection_close_done(OmegleAccount *oma)
 {
-	ssize_t len;
-	gchar *tmp;
+	GDestroyNotify close_func = oma->close_func;
 
-	len = omconn->rx_len;
-	tmp = g_strstr_len(omconn->rx_buf, len, "\r\n\r\n");
-	if (tmp == NULL) {
-		/* This is a corner case that occurs when the connection is
-		 * prematurely closed either on the client or the server.
-		 * This can either be no data at all or a partial set of
-		 * headers.  We pass along the data to be good, but don't
-		 * do any fancy massaging.  In all likelihood the result will
-		 * be tossed by the connection callback func anyways
-		 */
-		tmp = g_strndup(omconn->rx_buf, len);
-	} else {
-		tmp += 4;
-		len -= g_strstr_len(omconn->rx_buf, len, "\r\n\r\n") -
-				omconn->rx_buf + 4;
-		tmp = g_memdup(tmp, len + 1);
-		tmp[len] = '\0';
-		omconn->rx_buf[omconn->rx_len - len] = '\0';
-		om_update_cookies(omconn->oma, omconn->rx_buf);
-
-		if (strstr(omconn->rx_buf, "Content-Encoding: gzip"))
-		{
-			/* we've received compressed gzip data, decompress */
-			gchar *gunzipped;
-			gunzipped = om_gunzip((const guchar *)tmp, &len);
-			g_free(tmp);
-			tmp = gunzipped;
-		}
+	/* Keeps om_connection_destroy from scheduling us again */
+	oma->close_func = NULL;
+
+	if (oma->close_timer)
+	{
+		purple_timeout_remove(oma->close_timer);
+		oma->close_timer = 0;
 	}
+	while (oma->conns != NULL)
+		om_connection_destroy(oma->conns->data);
 
-	g_free(omconn->rx_buf);
-	omconn->rx_buf = NULL;
+	purple_signals_disconnect_by_handle(oma);
+	om_closing_accounts = g_slist_remove(om_closing_accounts, oma);
 
-	if (omconn->callback != NULL) {
-		purple_debug_info("omegle", "executing callback for %s\n", omconn->url);
-		omconn->callback(omconn->oma, tmp, len, omconn->user_data);
-	}
+	close_func(oma);
+}
 
-	g_free(tmp);
+static gboolean om_connection_close_timeout(gpointer data)
+{
+	OmegleAccount *oma = data;
+
+	oma->close_timer = 0;
+	if (oma->conns != NULL)
+		purple_debug_warning("omegle", "gave up on %u requests at close\n",
+				g_slist_length(oma->conns));
+	om_connection_close_done(oma);
+
+	return FALSE;
 }
 
-static void om_fatal_connection_cb(OmegleConnection *omconn)
+static void om_connection_close_soon(OmegleAccount *oma)
 {
-	PurpleConnection *pc = omconn->oma->pc;
+	if (oma->close_timer)
+		purple_timeout_remove(oma->close_timer);
+	oma->close_timer = purple_timeout_add(0, om_connection_close_timeout, oma);
+}
 
-	purple_debug_error("omegle", "fatal connection error\n");
+static void om_connection_account_destroying_cb(PurpleAccount *account,
+		gpointer data)
+{
+	OmegleAccount *oma = data;
 
-	om_connection_destroy(omconn);
+	/* The requests still read the account's settings */
+	if (account == oma->account)
+		om_connection_close_done(oma);
+}
 
-	/* We died.  Do not pass Go.  Do not collect $200 */
-	/* In all seriousness, don't attempt to call the normal callback here.
-	 * That may lead to the wrong error message being displayed */
-	purple_connection_error_reason(pc,
-				PURPLE_CONNECTION_ERROR_NETWORK_ERROR,
-				_("Server closed the connection."));
+static void om_connection_quitting_cb(void *data)
+{
+	om_quitting = TRUE;
 
+	while (om_closing_accounts != NULL)
+		om_connection_close_done(om_closing_accounts->data);
 }
 
-static void om_post_or_get_readdata_cb(gpointer data, gint source,
-		PurpleInputCondition cond)
+/**
+ * Hand a closed account over to be freed with close_func once its
+ * remaining requests are finished.  Requests somebody is waiting on
+ * an answer for, polls included, are cut off straight away; requests
+ * the rate limiter was holding back are sent now.
+ */
+void om_connection_close_account(OmegleAccount *oma,
+		GDestroyNotify close_func)
 {
 	OmegleConnection *omconn;
-	gchar buf[4096];
-	ssize_t len;
-
-	omconn = data;
+	GSList *l, *next;
 
-	if (omconn->method & OM_METHOD_SSL) {
-		len = purple_ssl_read(omconn->ssl_conn,
-				buf, sizeof(buf) - 1);
-	} else {
-		len = recv(omconn->fd, buf, sizeof(buf) - 1, 0);
-	}
+	oma->closing = TRUE;
 
-	if (len < 0)
+	for (l = oma->conns; l; l = next)
 	{
-		if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) {
-			/* Try again later */
-			return;
-		}
+		omconn = l->data;
+		next = l->next;
 
-		if (omconn->method & OM_METHOD_SSL && omconn->rx_len > 0) {
-			/*
-			 * This is a slightly hacky workaround for a bug in either
-			 * GNU TLS or in the SSL implementation on Omegle's web
-			 * servers.  The sequence of events is:
-			 * 1. We attempt to read the first time and successfully read
-			 *    the server's response.
-			 * 2. We attempt to read a second time and libpurple's call
-			 *    to gnutls_record_recv() returns the error
-			 *    GNUTLS_E_UNEXPECTED_PACKET_LENGTH, or
-			 *    "A TLS packet with unexpected length was received."
-			 *
-			 * Normally the server would have closed the connection
-			 * cleanly and this second read() request would have returned
-			 * 0.  Or maybe it's normal for SSL connections to be severed
-			 * in this manner?  In any case, this differs from the behavior
-			 * of the standard recv() system call.
-			 */
-			purple_debug_warning("omegle",
-				"ssl error, but data received.  attempting to continue\n");
-		} else {
-			/* TODO: Is this a regular occurrence?  If so then maybe resend the request? */
-			om_fatal_connection_cb(omconn);
-			return;
-		}
+		if (omconn->request == NULL || omconn->callback != NULL ||
+				omconn->parse_func != NULL || omconn->job != NULL)
+			om_connection_destroy(omconn);
 	}
 
-	if (len > 0)
+	while (oma->rate_queue != NULL)
 	{
-		buf[len] = '\0';
+		omconn = oma->rate_queue->data;
+		oma->rate_queue = g_slist_delete_link(oma->rate_queue,
+				oma->rate_queue);
+		om_connection_start_deferred(omconn);
+	}
 
-		omconn->rx_buf = g_realloc(omconn->rx_buf,
-				omconn->rx_len + len + 1);
-		memcpy(omconn->rx_buf + omconn->rx_len, buf, len + 1);
-		omconn->rx_len += len;
+	om_rate_limiter_destroy(oma);
+	om_connection_worker_destroy(oma);
 
-		/* Wait for more data before processing */
+	oma->close_func = close_func;
+	if (oma->conns == NULL || om_quitting)
+	{
+		om_connection_close_done(oma);
 		return;
 	}
 
-	/* The server closed the connection, let's parse the data */
-	om_connection_process_data(omconn);
+	purple_debug_info("omegle", "finishing %u requests before closing\n",
+			g_slist_length(oma->conns));
 
-	om_connection_destroy(omconn);
+	om_closing_accounts = g_slist_prepend(om_closing_accounts, oma);
+	oma->close_timer = purple_timeout_add(OM_CLOSE_TIMEOUT,
+			om_connection_close_timeout, oma);
+	purple_signal_connect(purple_accounts_get_handle(), "account-destroying",
+			oma, PURPLE_CALLBACK(om_connection_account_destroying_cb), oma);
 }
 
-static void om_post_or_get_ssl_readdata_cb (gpointer data,
-		PurpleSslConnection *ssl, PurpleInputCondition cond)
+/******************************************************************************/
+/* Form encoding */
+/******************************************************************************/
+
+/** Bytes that go into a form value as they are (RFC 3986 unreserved) */
+static const guchar om_form_safe[256] = {
+	0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+	0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+	0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 0,
+	1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 0, 0, 0, 0, 0, 0,
+	0, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,
+	1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 0, 0, 0, 0, 1,
+	0, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,
+	1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 0, 0, 0, 1, 0,
+	0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+	0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+	0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+	0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+	0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+	0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+	0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+	0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+};
+
+static const gchar om_hex_digits[] = "0123456789ABCDEF";
+
+static void om_form_append_encoded(GString *form, const gchar *value)
 {
-	om_post_or_get_readdata_cb(data, -1, cond);
+	const guchar *p = (const guchar *)value;
+	const guchar *run;
+	gchar escaped[3];
+
+	escaped[0] = '%';
+	while (*p)
+	{
+		/* Copy a whole run of plain characters at once */
+		run = p;
+		while (om_form_safe[*p])
+			p++;
+		if (p > run)
+			g_string_append_len(form, (const gchar *)run, p - run);
+		if (*p == '\0')
+			break;
+
+		escaped[1] = om_hex_digits[*p >> 4];
+		escaped[2] = om_hex_digits[*p & 0x0F];
+		g_string_append_len(form, escaped, 3);
+		p++;
+	}
 }
 
-static void om_post_or_get_connect_cb(gpointer data, gint source,
-		const gchar *error_message)
+/**
+ * Append name=value to an application/x-www-form-urlencoded body,
+ * encoding the value straight into the buffer.  Unlike
+ * purple_url_encode() this has no length limit and no static buffer.
+ */
+void om_form_append(GString *form, const gchar *name, const gchar *value)
 {
-	OmegleConnection *omconn;
-	ssize_t len;
-
-	omconn = data;
-	omconn->connect_data = NULL;
+	if (form->len > 0)
+		g_string_append_c(form, '&');
+	g_string_append(form, name);
+	g_string_append_c(form, '=');
+	if (value != NULL)
+		om_form_append_encoded(form, value);
+}
 
-	if (error_message)
-	{
-		purple_debug_error("omegle", "post_or_get_connect failure to %s\n", omconn->url);
-		purple_debug_error("omegle", "post_or_get_connect_cb %s\n",
-				error_message);
-		om_fatal_connection_cb(omconn);
-		return;
-	}
+/******************************************************************************/
+/* Rate limiting */
+/******************************************************************************/
 
-	omconn->fd = source;
+/*
+ * Outgoing requests draw a token from a bucket for their server and one
+ * for their server and endpoint class.  Requests that can't get both
+ * wait in oma->rate_queue, sorted so that /send and control requests
+ * are let out before /events and /typing when the budget is tight.
+ */
 
-	/* TODO: Check the return value of write() */
-	len = write(omconn->fd, omconn->request->str,
-			omconn->request->len);
-	omconn->input_watcher = purple_input_add(omconn->fd,
-			PURPLE_INPUT_READ,
-			om_post_or_get_readdata_cb, omconn);
+typedef struct _OmegleRateBucket OmegleRateBucket;
+struct _OmegleRateBucket {
+	gdouble tokens;
+	gint64 last_refill;
+};
+
+/* Tokens per second and burst size, by OmegleRateClass */
+static const struct {
+	gdouble rate;
+	gdouble burst;
+} om_rate_limits[OM_RATE_CLASSES] = {
+	{ 2.0, 5.0 },	/* OM_RATE_CONTROL */
+	{ 4.0, 8.0 },	/* OM_RATE_SEND */
+	{ 5.0, 10.0 },	/* OM_RATE_EVENTS */
+	{ 1.0, 3.0 },	/* OM_RATE_TYPING */
+};
+#define OM_RATE_SERVER_RATE 10.0
+#define OM_RATE_SERVER_BURST 20.0
+
+static OmegleRateClass om_rate_class(const gchar *url)
+{
+	if (g_str_equal(url, "/send"))
+		return OM_RATE_SEND;
+	if (g_str_equal(url, "/events"))
+		return OM_RATE_EVENTS;
+	if (g_str_equal(url, "/typing") || g_str_equal(url, "/stoppedtyping"))
+		return OM_RATE_TYPING;
+	return OM_RATE_CONTROL;
 }
 
-static void om_post_or_get_ssl_connect_cb(gpointer data,
-		PurpleSslConnection *ssl, PurpleInputCondition cond)
+static OmegleRateBucket *om_rate_bucket(OmegleAccount *oma, gchar *key,
+		gdouble rate, gdouble burst)
 {
-	OmegleConnection *omconn;
-	ssize_t len;
+	OmegleRateBucket *bucket;
+	gint64 now = g_get_monotonic_time();
 
-	omconn = data;
+	bucket = g_hash_table_lookup(oma->rate_buckets, key);
+	if (bucket == NULL)
+	{
+		bucket = g_new0(OmegleRateBucket, 1);
+		bucket->tokens = burst;
+		bucket->last_refill = now;
+		g_hash_table_insert(oma->rate_buckets, key, bucket);
+	} else {
+		g_free(key);
+		bucket->tokens += rate * (now - bucket->last_refill) / G_USEC_PER_SEC;
+		if (bucket->tokens > burst)
+			bucket->tokens = burst;
+		bucket->last_refill = now;
+	}
 
-	purple_debug_info("omegle", "post_or_get_ssl_connect_cb\n");
+	return bucket;
+}
 
-	/* TODO: Check the return value of write() */
-	len = purple_ssl_write(omconn->ssl_conn,
-			omconn->request->str, omconn->request->len);
-	purple_ssl_input_add(omconn->ssl_conn,
-			om_post_or_get_ssl_readdata_cb, omconn);
+static gboolean om_rate_acquire(OmegleAccount *oma, const gchar *host,
+		OmegleRateClass rate_class)
+{
+	OmegleRateBucket *server, *endpoint;
+
+	/* A closing account's last requests all go out together */
+	if (oma->closing)
+		return TRUE;
+	if (!purple_account_get_bool(oma->account, "rate_limit", TRUE))
+		return TRUE;
+
+	server = om_rate_bucket(oma, g_strdup(host),
+			OM_RATE_SERVER_RATE, OM_RATE_SERVER_BURST);
+	endpoint = om_rate_bucket(oma, g_strdup_printf("%s/%d", host, rate_class),
+			om_rate_limits[rate_class].rate,
+			om_rate_limits[rate_class].burst);
+
+	if (server->tokens < 1.0 || endpoint->tokens < 1.0)
+		return FALSE;
+
+	server->tokens -= 1.0;
+	endpoint->tokens -= 1.0;
+	return TRUE;
 }
 
-static void om_host_lookup_cb(GSList *hosts, gpointer data,
-		const char *error_message)
+static gint om_rate_queue_compare(gconstpointer a, gconstpointer b)
 {
-	GSList *host_lookup_list;
-	struct sockaddr_in *addr;
-	gchar *hostname;
-	gchar *ip_address;
-	OmegleAccount *oma;
-	PurpleDnsQueryData *query;
+	const OmegleConnection *new_conn = a;
+	const OmegleConnection *queued = b;
 
-	/* Extract variables */
-	host_lookup_list = data;
+	if (new_conn->rate_class != queued->rate_class)
+		return new_conn->rate_class - queued->rate_class;
 
-	oma = host_lookup_list->data;
-	host_lookup_list =
-			g_slist_delete_link(host_lookup_list, host_lookup_list);
-	hostname = host_lookup_list->data;
-	host_lookup_list =
-			g_slist_delete_link(host_lookup_list, host_lookup_list);
-	query = host_lookup_list->data;
-	host_lookup_list =
-			g_slist_delete_link(host_lookup_list, host_lookup_list);
+	/* Keep requests of the same class in the order they were made */
+	return 1;
+}
 
-	/* The callback has executed, so we no longer need to keep track of
-	 * the original query.  This always needs to run when the cb is 
-	 * executed. */
-	oma->dns_queries = g_slist_remove(oma->dns_queries, query);
+static gboolean om_rate_queue_run(gpointer data)
+{
+	OmegleAccount *oma = data;
+	GSList *l, *next;
 
-	/* Any problems, capt'n? */
-	if (error_message != NULL)
+	for (l = oma->rate_queue; l; l = next)
 	{
-		purple_debug_warning("omegle",
-				"Error doing host lookup: %s\n", error_message);
-		return;
+		OmegleConnection *omconn = l->data;
+		next = l->next;
+
+		if (!om_rate_acquire(oma, omconn->origin_host, omconn->rate_class))
+			continue;
+
+		oma->rate_queue = g_slist_delete_link(oma->rate_queue, l);
+		oma->stats.rate_wait_usec +=
+				g_get_monotonic_time() - omconn->queued_time;
+		om_connection_start_deferred(omconn);
 	}
 
-	if (hosts == NULL)
+	if (oma->rate_queue == NULL)
 	{
-		purple_debug_warning("omegle",
-				"Could not resolve host name\n");
-		return;
+		oma->rate_timer = 0;
+		return FALSE;
 	}
+	return TRUE;
+}
 
-	/* Discard the length... */
-	hosts = g_slist_delete_link(hosts, hosts);
-	/* Copy the address then free it... */
-	addr = hosts->data;
-	ip_address = g_strdup(inet_ntoa(addr->sin_addr));
-	g_free(addr);
-	hosts = g_slist_delete_link(hosts, hosts);
+static void om_rate_defer(OmegleConnection *omconn)
+{
+	OmegleAccount *oma = omconn->oma;
 
-	/*
-	 * DNS lookups can return a list of IP addresses, but we only cache
-	 * the first one.  So free the rest.
-	 */
-	while (hosts != NULL)
-	{
-		/* Discard the length... */
-		hosts = g_slist_delete_link(hosts, hosts);
-		/* Free the address... */
-		g_free(hosts->data);
-		hosts = g_slist_delete_link(hosts, hosts);
-	}
+	om_trace(omconn->id, OM_TRACE_DEFERRED, 0);
+
+	omconn->queued_time = g_get_monotonic_time();
+	oma->rate_queue = g_slist_insert_sorted(oma->rate_queue, omconn,
+			om_rate_queue_compare);
+	oma->stats.rate_deferred[omconn->rate_class]++;
 
-	g_hash_table_insert(oma->hostname_ip_cache, hostname, ip_address);
+	if (oma->rate_timer == 0)
+		oma->rate_timer = purple_timeout_add(OM_RATE_TICK,
+				om_rate_queue_run, oma);
 }
 
-static void om_cookie_foreach_cb(gchar *cookie_name,
-		gchar *cookie_value, GString *str)
+void om_rate_limiter_init(OmegleAccount *oma)
 {
-	/* TODO: Need to escape name and value? */
-	g_string_append_printf(str, "%s=%s;", cookie_name, cookie_value);
+	oma->rate_buckets = g_hash_table_new_full(g_str_hash, g_str_equal,
+			g_free, g_free);
+}
+
+void om_rate_limiter_destroy(OmegleAccount *oma)
+{
+	if (oma->rate_timer)
+	{
+		purple_timeout_remove(oma->rate_timer);
+		oma->rate_timer = 0;
+	}
+	g_hash_table_destroy(oma->rate_buckets);
+	oma->rate_buckets = NULL;
 }
 
 /**
- * Serialize the oma->cookie_table hash table to a string.
+ * The Basic credentials for the proxy, encoded once and kept until the
+ * proxy settings change.
  */
-static gchar *om_cookies_to_string(OmegleAccount *oma)
+static const gchar *om_proxy_authorization(OmegleAccount *oma,
+		PurpleProxyInfo *proxy_info)
 {
-	GString *str;
+	const gchar *username, *password;
+	gchar *plain;
 
-	str = g_string_new(NULL);
+	username = purple_proxy_info_get_username(proxy_info);
+	password = purple_proxy_info_get_password(proxy_info);
+	if (username == NULL || password == NULL)
+		return NULL;
 
-	g_hash_table_foreach(oma->cookie_table,
-			(GHFunc)om_cookie_foreach_cb, str);
+	if (oma->proxy_auth != NULL &&
+		g_str_equal(username, oma->proxy_username) &&
+		g_str_equal(password, oma->proxy_password))
+		return oma->proxy_auth;
 
-	return g_string_free(str, FALSE);
+	g_free(oma->proxy_username);
+	g_free(oma->proxy_password);
+	g_free(oma->proxy_auth);
+	oma->proxy_username = g_strdup(username);
+	oma->proxy_password = g_strdup(password);
+
+	plain = g_strdup_printf("%s:%s", username, password);
+	oma->proxy_auth = purple_base64_encode((guchar *)plain, strlen(plain));
+	g_free(plain);
+
+	return oma->proxy_auth;
 }
 
-static void om_ssl_connection_error(PurpleSslConnection *ssl,
-		PurpleSslErrorType errortype, gpointer data)
+void om_proxy_authorization_free(OmegleAccount *oma)
 {
-	OmegleConnection *omconn = data;
-	PurpleConnection *pc = omconn->oma->pc;
-
-	omconn->ssl_conn = NULL;
-	om_connection_destroy(omconn);
-	purple_connection_ssl_error(pc, errortype);
+	g_free(oma->proxy_username);
+	g_free(oma->proxy_password);
+	g_free(oma->proxy_auth);
+	oma->proxy_username = NULL;
+	oma->proxy_password = NULL;
+	oma->proxy_auth = NULL;
 }
 
-void om_post_or_get(OmegleAccount *oma, OmegleMethod method,
-		const gchar *host, const gchar *url, const gchar *postdata,
-		OmegleProxyCallbackFunc callback_func, gpointer user_data,
-		gboolean keepalive)
+OmegleConnection *om_post_or_get(OmegleAccount *oma, OmegleMethod method,
+		const gchar *host, const gchar *url, const GString *postdata,
+		OmegleProxyCallbackFunc callback_func, gpointer user_data)
 {
+	gboolean keepalive;
 	GString *request;
 	gchar *cookies;
 	OmegleConnection *omconn;
@@ -455,20 +2194,32 @@ void om_post_or_get(OmegleAccount *oma, OmegleMethod method,
 	const gchar* const *languages;
 	gchar *language_names;
 	PurpleProxyInfo *proxy_info = NULL;
-	gchar *proxy_auth;
-	gchar *proxy_auth_base64;
+	const gchar *proxy_auth;
+	const gchar *origin_host;
+	OmegleRateClass rate_class;
+	gboolean rate_ok;
+	gsize postdata_len;
+	guint profile;
 
-	/* TODO: Fix keepalive and use it as much as possible */
-	keepalive = FALSE;
+	/* A stream only ends when the server hangs up */
+	keepalive = !(method & OM_METHOD_STREAM) &&
+			purple_account_get_bool(oma->account, "keepalive", TRUE);
+
+	rate_class = om_rate_class(url);
+	profile = om_profile_enter(OM_PHASE_BUILD, rate_class);
 
 	if (host == NULL)
 		host = purple_account_get_string(oma->account, "host", "bajor.omegle.com");
+	origin_host = host;
+
+	if (purple_account_get_bool(oma->account, "use_https", FALSE))
+		method |= OM_METHOD_SSL;
 
+	/* For TLS libpurple opens a CONNECT tunnel through an HTTP proxy,
+	 * and the request inside it is the same as a direct one */
 	if (oma && oma->account && !(method & OM_METHOD_SSL))
 	{
-		proxy_info = purple_proxy_get_setup(oma->account);
-		if (purple_proxy_info_get_type(proxy_info) == PURPLE_PROXY_USE_GLOBAL)
-			proxy_info = purple_global_proxy_get_info();
+		proxy_info = om_connection_proxy_info(oma);
 		if (purple_proxy_info_get_type(proxy_info) == PURPLE_PROXY_HTTP)
 		{
 			is_proxy = TRUE;
@@ -484,14 +2235,14 @@ void om_post_or_get(OmegleAccount *oma, OmegleMethod method,
 	cookies = om_cookies_to_string(oma);
 	user_agent = purple_account_get_string(oma->account, "user-agent", "Opera/9.50 (Windows NT 5.1; U; en-GB)");
 	
-	if (method & OM_METHOD_POST && !postdata)
-		postdata = "";
+	postdata_len = postdata ? postdata->len : 0;
 
-	/* Build the request */
-	request = g_string_new(NULL);
-	g_string_append_printf(request, "%s %s HTTP/1.0\r\n",
+	/* Build the request, with room for the body so it's copied once */
+	request = g_string_sized_new(512 + postdata_len);
+	/* Chunked encoding, which a stream may well use, needs HTTP/1.1 */
+	g_string_append_printf(request, "%s %s HTTP/1.%d\r\n",
 			(method & OM_METHOD_POST) ? "POST" : "GET",
-			real_url);
+			real_url, (method & OM_METHOD_STREAM) ? 1 : 0);
 	if (is_proxy == FALSE)
 		g_string_append_printf(request, "Host: %s\r\n", host);
 	g_string_append_printf(request, "Connection: %s\r\n",
@@ -501,22 +2252,21 @@ void om_post_or_get(OmegleAccount *oma, OmegleMethod method,
 		g_string_append_printf(request,
 				"Content-Type: application/x-www-form-urlencoded\r\n");
 		g_string_append_printf(request,
-				"Content-length: %zu\r\n", strlen(postdata));
+				"Content-length: %" G_GSIZE_FORMAT "\r\n", postdata_len);
 	}
-	g_string_append_printf(request, "Accept: application/json, text/html, */*\r\n");
+	if (method & OM_METHOD_STREAM)
+		g_string_append_printf(request, "Accept: text/event-stream, application/json, */*\r\n");
+	else
+		g_string_append_printf(request, "Accept: application/json, text/html, */*\r\n");
 	g_string_append_printf(request, "Cookie: %s\r\n", cookies);
-	g_string_append_printf(request, "Accept-Encoding: gzip\r\n");
+	/* A stream can't be inflated a piece at a time */
+	if (!(method & OM_METHOD_STREAM))
+		g_string_append_printf(request, "Accept-Encoding: gzip\r\n");
 	if (is_proxy == TRUE)
 	{
-		if (purple_proxy_info_get_username(proxy_info) &&
-			purple_proxy_info_get_password(proxy_info))
-		{
-			proxy_auth = g_strdup_printf("%s:%s", purple_proxy_info_get_username(proxy_info), purple_proxy_info_get_password(proxy_info));
-			proxy_auth_base64 = purple_base64_encode((guchar *)proxy_auth, strlen(proxy_auth));
-			g_string_append_printf(request, "Proxy-Authorization: Basic %s\r\n", proxy_auth_base64);
-			g_free(proxy_auth_base64);
-			g_free(proxy_auth);
-		}
+		proxy_auth = om_proxy_authorization(oma, proxy_info);
+		if (proxy_auth != NULL)
+			g_string_append_printf(request, "Proxy-Authorization: Basic %s\r\n", proxy_auth);
 	}
 
 	/* Tell the server what language we accept, so that we get error messages in our language (rather than our IP's) */
@@ -526,18 +2276,20 @@ void om_post_or_get(OmegleAccount *oma, OmegleMethod method,
 	g_string_append_printf(request, "Accept-Language: %s\r\n", language_names);
 	g_free(language_names);
 
-	purple_debug_info("omegle", "getting url %s\n", url);
+	if (purple_debug_is_verbose())
+		purple_debug_info("omegle", "getting url %s\n", url);
 
 	g_string_append_printf(request, "\r\n");
-	if (method & OM_METHOD_POST)
-		g_string_append_printf(request, "%s", postdata);
+	if (method & OM_METHOD_POST && postdata_len > 0)
+		g_string_append_len(request, postdata->str, postdata_len);
 
 	/* If it needs to go over a SSL connection, we probably shouldn't print
 	 * it in the debug log.  Without this condition a user's password is
 	 * printed in the debug log */
-	if (method == OM_METHOD_POST)
+	if ((method & ~OM_METHOD_STREAM) == OM_METHOD_POST && postdata_len > 0 &&
+			purple_debug_is_verbose())
 		purple_debug_info("omegle", "sending request data:\n%s\n",
-			postdata);
+			postdata->str);
 
 	g_free(cookies);
 
@@ -549,49 +2301,76 @@ void om_post_or_get(OmegleAccount *oma, OmegleMethod method,
 	 *       purple_proxy_connect(), so we could re-use the result.
 	 *       Or even better: Use persistent HTTP connections for servers
 	 *       that we access continually.
-	 *
-	 * TODO: This cache of the hostname<-->IP address does not respect
-	 *       the TTL returned by the DNS server.  We should expire things
-	 *       from the cache after some amount of time.
 	 */
-	if (!is_proxy)
+	if (!is_proxy && !(method & OM_METHOD_SSL))
 	{
-		/* Don't do this for proxy connections, since proxies do the DNS lookup */
-		gchar *host_ip;
+		/* Don't do this for proxy connections, since proxies do the DNS
+		 * lookup, or for TLS, which checks the certificate and sends SNI
+		 * for the name we connect to */
+		const gchar *host_ip;
 
-		host_ip = g_hash_table_lookup(oma->hostname_ip_cache, host);
-		if (host_ip != NULL) {
+		host_ip = om_host_lookup(oma, host);
+		if (host_ip != NULL)
 			host = host_ip;
-		} else if (oma->account && !oma->account->disconnecting) {
-			GSList *host_lookup_list = NULL;
-			PurpleDnsQueryData *query;
-
-			host_lookup_list = g_slist_prepend(
-					host_lookup_list, g_strdup(host));
-			host_lookup_list = g_slist_prepend(
-					host_lookup_list, oma);
-
-			query = purple_dnsquery_a(host, 80,
-					om_host_lookup_cb, host_lookup_list);
-			oma->dns_queries = g_slist_prepend(oma->dns_queries, query);
-			host_lookup_list = g_slist_append(host_lookup_list, query);
-		}
+	}
+
+	rate_ok = om_rate_acquire(oma, origin_host, rate_class);
+
+	omconn = rate_ok ?
+			om_connection_take_warm(oma, origin_host, method, rate_class) : NULL;
+	if (omconn != NULL)
+	{
+		/* Already connected, so the request can go straight out.  Through
+		 * an HTTP proxy it may have been opened for another server. */
+		g_free(omconn->origin_host);
+		omconn->origin_host = g_strdup(origin_host);
+		omconn->url = real_url;
+		omconn->method = method;
+		omconn->request = request;
+		omconn->callback = callback_func;
+		omconn->user_data = user_data;
+		omconn->connection_keepalive = keepalive;
+		omconn->request_time = time(NULL);
+		omconn->rate_class = rate_class;
+		omconn->reused = TRUE;
+		oma->stats.warm_hits++;
+
+		om_connection_set_deadline(omconn);
+		om_connection_send_request(omconn);
+
+		om_profile_leave(profile);
+		return omconn;
 	}
 
 	omconn = g_new0(OmegleConnection, 1);
 	omconn->oma = oma;
+	omconn->id = om_trace_connection_id();
 	omconn->url = real_url;
 	omconn->method = method;
 	omconn->hostname = g_strdup(host);
+	omconn->origin_host = g_strdup(origin_host);
 	omconn->request = request;
 	omconn->callback = callback_func;
 	omconn->user_data = user_data;
 	omconn->fd = -1;
 	omconn->connection_keepalive = keepalive;
 	omconn->request_time = time(NULL);
+	omconn->rate_class = rate_class;
 	oma->conns = g_slist_prepend(oma->conns, omconn);
 
+	if (!rate_ok)
+	{
+		/* The caller still gets the connection so it can be cancelled
+		 * while it waits */
+		om_rate_defer(omconn);
+		om_profile_leave(profile);
+		return omconn;
+	}
+
 	om_attempt_connection(omconn);
+
+	om_profile_leave(profile);
+	return omconn;
 }
 
 static void om_attempt_connection(OmegleConnection *omconn)
@@ -618,9 +2397,14 @@ static void om_attempt_connection(OmegleConnection *omconn)
 	/* TODO/FIXME: this doesn't retry properly on non-ssl connections */
 #endif
 
+	omconn->connect_start = g_get_monotonic_time();
+	om_trace(omconn->id, OM_TRACE_CONNECTING, 0);
+	if (omconn->request != NULL)
+		om_connection_set_deadline(omconn);
+
 	if (omconn->method & OM_METHOD_SSL) {
-		omconn->ssl_conn = purple_ssl_connect(oma->account, omconn->hostname,
-				443, om_post_or_get_ssl_connect_cb,
+		omconn->ssl_conn = purple_ssl_connect(oma->account,
+				omconn->origin_host, 443, om_post_or_get_ssl_connect_cb,
 				om_ssl_connection_error, omconn);
 	} else {
 		omconn->connect_data = purple_proxy_connect(NULL, oma->account,
@@ -30,32 +30,139 @@ typedef enum
 {
 	OM_METHOD_GET  = 0x0001,
 	OM_METHOD_POST = 0x0002,
-	OM_METHOD_SSL  = 0x0004
+	OM_METHOD_SSL  = 0x0004,
+	OM_METHOD_STREAM = 0x0008 /**< Ask for text/event-stream */
 } OmegleMethod;
 
+#define OM_MAX_WARM_CONNS 4
+#define OM_WARM_CONN_MAX_AGE 25
+#define OM_WARM_CHECK_INTERVAL 20
+#define OM_DNS_CACHE_TTL 300
+
+#define OM_READ_INITIAL_SIZE 4096
+#define OM_READ_MIN_ROOM 1024
+
+#define OM_RATE_TICK 100
+
+#define OM_CLOSE_TIMEOUT 3000 /**< ms a closing account's last requests get */
+
+/* Seconds a request may go without hearing anything from the server */
+#define OM_REQUEST_TIMEOUT 30
+#define OM_EVENTS_TIMEOUT 75 /**< A little over how long /events is held open */
+#define OM_TIMEOUTS_NETWORK_LOST 3 /**< In a row, before the network is blamed */
+
+/* Size limits in KiB, all of which can be changed per account */
+#define OM_DEFAULT_MAX_HEADER_KB 16
+#define OM_DEFAULT_MAX_BODY_KB 1024
+#define OM_DEFAULT_MAX_INFLATED_KB 4096
+#define OM_DEFAULT_MEMORY_BUDGET_KB 16384
+
 typedef struct _OmegleConnection OmegleConnection;
+typedef struct _OmegleConnectionJob OmegleConnectionJob;
+
+/** Turns a response body into something else.  Must be thread safe. */
+typedef gpointer (*OmegleParseFunc)(const gchar *data, gsize len);
+typedef void (*OmegleParsedCallbackFunc)(OmegleAccount *oma, gpointer parsed,
+		gpointer user_data);
+
 struct _OmegleConnection {
 	OmegleAccount *oma;
+	guint32 id; /**< Tells this connection apart in the trace */
 	OmegleMethod method;
 	gchar *hostname;
+	gchar *origin_host; /**< The host asked for, hostname may be a cached IP */
 	gchar *url;
 	GString *request;
 	OmegleProxyCallbackFunc callback;
+	OmegleParseFunc parse_func;
+	OmegleParsedCallbackFunc parsed_callback; /**< Used instead of callback */
+	GDestroyNotify parsed_free;
 	gpointer user_data;
+	GDestroyNotify lost_func; /**< Given user_data if destroyed before delivering */
+	gboolean expendable; /**< Failing to connect only fails this request */
 	char *rx_buf;
 	size_t rx_len;
+	gsize rx_size; /**< Allocated size of rx_buf */
+	gsize header_len; /**< 0 until the end of the headers has arrived */
+	gboolean has_content_length;
+	guint64 content_length;
+	gboolean server_keepalive; /**< The response said "Connection: keep-alive" */
 	PurpleProxyConnectData *connect_data;
 	PurpleSslConnection *ssl_conn;
 	int fd;
 	guint input_watcher;
 	gboolean connection_keepalive;
+	gboolean reused; /**< The request went out on a socket that was already open */
+	guint timeout_timer; /**< Running while the request waits on the server */
 	time_t request_time;
+	gint64 connect_start;
+	gint64 connect_time; /**< When the connection came up, 0 until then */
+	OmegleRateClass rate_class;
+	gint64 queued_time; /**< When the rate limiter held this request back */
+	OmegleConnectionJob *job; /**< Response being handled on the worker thread */
+	gchar *pool_key; /**< Set while idle in the shared pool */
+	OmegleParsedCallbackFunc stream_callback; /**< Takes events as they stream in */
+	gboolean streaming; /**< The response turned out to be an event stream */
+	gboolean stream_chunked;
+	gsize chunk_left; /**< Bytes of the current chunk still to come */
+	gboolean chunk_crlf; /**< The line ending a chunk's data is still to come */
+	GString *stream_buf; /**< Decoded body not yet making up a whole event */
+};
+
+/**
+ * A response on its way through the worker thread.  It starts out as
+ * the raw response, headers and all.  Only data, len, headers, gzipped,
+ * error and parsed are written there.
+ */
+struct _OmegleConnectionJob {
+	OmegleConnection *omconn;
+	OmegleAccount *oma;
+	guint32 conn_id;
+	gchar *data;
+	gsize len;
+	gsize charged; /**< Counted against the account's memory budget */
+	gsize max_inflated;
+	OmegleRateClass rate_class;
+	gboolean raw; /**< data still has the headers in front of the body */
+	gchar *headers; /**< Split off by the worker, for the cookies */
+	gboolean gzipped;
+	const gchar *error;
+	OmegleParseFunc parse_func;
+	gpointer parsed;
+	GDestroyNotify parsed_free;
+	gboolean cancelled; /**< The connection went away in the meantime */
 };
 
+void om_connection_close_account(OmegleAccount *oma,
+		GDestroyNotify close_func);
+gboolean om_connection_over_budget(OmegleAccount *oma);
+typedef void (*OmegleDnsFunc)(const gchar *host, const gchar *ip,
+		gint64 expires, gpointer data);
+
+void om_dns_cache_foreach(OmegleDnsFunc func, gpointer data);
+gboolean om_dns_cache_restore(const gchar *host, const gchar *ip,
+		gint64 expires);
+void om_connection_pool_init(void);
+void om_connection_pool_destroy(void);
 void om_connection_destroy(OmegleConnection *omconn);
-void om_post_or_get(OmegleAccount *oma, OmegleMethod method,
-		const gchar *host, const gchar *url, const gchar *postdata,
-		OmegleProxyCallbackFunc callback_func, gpointer user_data,
-		gboolean keepalive);
+void om_connection_prewarm(OmegleAccount *oma, const gchar *host,
+		OmegleMethod method);
+void om_connection_set_parser(OmegleConnection *omconn,
+		OmegleParseFunc parse_func, OmegleParsedCallbackFunc parsed_callback,
+		GDestroyNotify parsed_free);
+void om_connection_set_stream(OmegleConnection *omconn,
+		OmegleParsedCallbackFunc stream_callback);
+void om_connection_set_lost_func(OmegleConnection *omconn,
+		GDestroyNotify lost_func);
+void om_connection_set_expendable(OmegleConnection *omconn);
+void om_connection_worker_init(OmegleAccount *oma);
+void om_connection_worker_destroy(OmegleAccount *oma);
+void om_form_append(GString *form, const gchar *name, const gchar *value);
+void om_proxy_authorization_free(OmegleAccount *oma);
+void om_rate_limiter_init(OmegleAccount *oma);
+void om_rate_limiter_destroy(OmegleAccount *oma);
+OmegleConnection *om_post_or_get(OmegleAccount *oma, OmegleMethod method,
+		const gchar *host, const gchar *url, const GString *postdata,
+		OmegleProxyCallbackFunc callback_func, gpointer user_data);
 
 #endif /* OMEGLE_CONNECTION_H */
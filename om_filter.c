@@ -0,0 +1,313 @@
+/*
+ * libomegle
+ *
+ * libomegle is the property of its developers.  See the COPYRIGHT file
+ * for more details.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#include "om_filter.h"
+#include "om_session.h"
+
+/*
+ * Spam phrases are compiled into a single Aho-Corasick automaton when
+ * the account connects, so checking a message is one pass over its
+ * bytes however many phrases there are.  Matching ignores ASCII case.
+ *
+ * Transitions out of the root, which is where most bytes of most
+ * messages land, are a plain table.  The rest live in one hash table
+ * keyed by state and byte.
+ */
+
+struct _OmegleFilter {
+	guint root[256];
+	GHashTable *edges; /**< (state << 8 | byte) -> state */
+	GArray *fail; /**< guint, state to fall back to on a mismatch */
+	GArray *output; /**< gboolean, a phrase ends here */
+	guint patterns;
+};
+
+#define OM_FILTER_EDGE_KEY(state, c) GUINT_TO_POINTER(((state) << 8) | (c))
+
+static guint om_filter_goto(OmegleFilter *filter, guint state, guchar c)
+{
+	if (state == 0)
+		return filter->root[c];
+	return GPOINTER_TO_UINT(g_hash_table_lookup(filter->edges,
+			OM_FILTER_EDGE_KEY(state, c)));
+}
+
+static guint om_filter_new_state(OmegleFilter *filter)
+{
+	guint zero = 0;
+	gboolean no = FALSE;
+
+	g_array_append_val(filter->fail, zero);
+	g_array_append_val(filter->output, no);
+
+	return filter->fail->len - 1;
+}
+
+static void om_filter_add(OmegleFilter *filter, const gchar *pattern,
+		GArray *parents, GArray *bytes)
+{
+	const guchar *p;
+	guint state = 0, next;
+	guchar c;
+
+	if (*pattern == '\0')
+		return;
+	if (filter->fail->len + strlen(pattern) > OM_FILTER_MAX_STATES)
+	{
+		purple_debug_warning("omegle", "too many spam phrases, "
+				"ignoring \"%s\"\n", pattern);
+		return;
+	}
+
+	for (p = (const guchar *)pattern; *p; p++)
+	{
+		c = g_ascii_tolower(*p);
+		next = om_filter_goto(filter, state, c);
+		if (next == 0)
+		{
+			next = om_filter_new_state(filter);
+			g_array_append_val(parents, state);
+			g_array_append_val(bytes, c);
+			if (state == 0)
+				filter->root[c] = next;
+			else
+				g_hash_table_insert(filter->edges,
+						OM_FILTER_EDGE_KEY(state, c), GUINT_TO_POINTER(next));
+		}
+		state = next;
+	}
+
+	if (!g_array_index(filter->output, gboolean, state))
+	{
+		g_array_index(filter->output, gboolean, state) = TRUE;
+		filter->patterns++;
+	}
+}
+
+/**
+ * Work out the failure links, shallowest states first.
+ */
+static void om_filter_link(OmegleFilter *filter, GArray *parents,
+		GArray *bytes)
+{
+	GQueue *queue;
+	guint state, child, fallback, next;
+	guint i;
+	GSList **children;
+
+	/* The trie only knows child -> parent, so turn that around */
+	children = g_new0(GSList *, filter->fail->len);
+	for (i = filter->fail->len - 1; i > 0; i--)
+	{
+		state = g_array_index(parents, guint, i - 1);
+		children[state] = g_slist_prepend(children[state], GUINT_TO_POINTER(i));
+	}
+
+	queue = g_queue_new();
+	g_queue_push_tail(queue, GUINT_TO_POINTER(0));
+	while (!g_queue_is_empty(queue))
+	{
+		state = GPOINTER_TO_UINT(g_queue_pop_head(queue));
+		while (children[state] != NULL)
+		{
+			child = GPOINTER_TO_UINT(children[state]->data);
+			children[state] = g_slist_delete_link(children[state],
+					children[state]);
+			g_queue_push_tail(queue, GUINT_TO_POINTER(child));
+
+			if (state == 0)
+				continue;
+
+			fallback = g_array_index(filter->fail, guint, state);
+			while ((next = om_filter_goto(filter, fallback,
+					g_array_index(bytes, guchar, child - 1))) == 0 &&
+					fallback != 0)
+				fallback = g_array_index(filter->fail, guint, fallback);
+			g_array_index(filter->fail, guint, child) = next;
+			if (g_array_index(filter->output, gboolean, next))
+				g_array_index(filter->output, gboolean, child) = TRUE;
+		}
+	}
+
+	g_queue_free(queue);
+	g_free(children);
+}
+
+static void om_filter_add_list(OmegleFilter *filter, const gchar *list,
+		const gchar *separators, GArray *parents, GArray *bytes)
+{
+	gchar **patterns;
+	guint i;
+
+	patterns = g_strsplit_set(list, separators, -1);
+	for (i = 0; patterns[i] != NULL; i++)
+		om_filter_add(filter, g_strstrip(patterns[i]), parents, bytes);
+	g_strfreev(patterns);
+}
+
+/**
+ * Build the spam filter from the account settings.  Phrases come from
+ * the comma separated "spam_patterns" option and from "spam_pattern_file",
+ * one per line.
+ */
+void om_filter_init(OmegleAccount *oma)
+{
+	OmegleFilter *filter;
+	GArray *parents, *bytes;
+	const gchar *list, *filename;
+	gchar *contents;
+	GError *error = NULL;
+
+	if (!purple_account_get_bool(oma->account, "spam_filter", FALSE))
+		return;
+
+	filter = g_new0(OmegleFilter, 1);
+	filter->edges = g_hash_table_new(g_direct_hash, g_direct_equal);
+	filter->fail = g_array_new(FALSE, FALSE, sizeof(guint));
+	filter->output = g_array_new(FALSE, FALSE, sizeof(gboolean));
+	om_filter_new_state(filter);
+
+	/* Parent and incoming byte of each state but the root */
+	parents = g_array_new(FALSE, FALSE, sizeof(guint));
+	bytes = g_array_new(FALSE, FALSE, sizeof(guchar));
+
+	list = purple_account_get_string(oma->account, "spam_patterns", NULL);
+	if (list != NULL)
+		om_filter_add_list(filter, list, ",", parents, bytes);
+
+	filename = purple_account_get_string(oma->account, "spam_pattern_file", NULL);
+	if (filename != NULL && *filename)
+	{
+		if (g_file_get_contents(filename, &contents, NULL, &error))
+		{
+			om_filter_add_list(filter, contents, "\r\n", parents, bytes);
+			g_free(contents);
+		} else {
+			purple_debug_warning("omegle", "could not read spam phrases: %s\n",
+					error->message);
+			g_clear_error(&error);
+		}
+	}
+
+	om_filter_link(filter, parents, bytes);
+	g_array_free(parents, TRUE);
+	g_array_free(bytes, TRUE);
+
+	purple_debug_info("omegle", "spam filter has %u phrases, %u states\n",
+			filter->patterns, filter->fail->len);
+
+	oma->filter = filter;
+}
+
+static gboolean om_filter_match(OmegleFilter *filter, const gchar *message)
+{
+	const guchar *p;
+	guint state = 0, next;
+	guchar c;
+
+	if (filter->patterns == 0)
+		return FALSE;
+
+	for (p = (const guchar *)message; *p; p++)
+	{
+		c = g_ascii_tolower(*p);
+		while ((next = om_filter_goto(filter, state, c)) == 0 && state != 0)
+			state = g_array_index(filter->fail, guint, state);
+		state = next;
+		if (g_array_index(filter->output, gboolean, state))
+			return TRUE;
+	}
+
+	return FALSE;
+}
+
+/**
+ * Decide whether a message looks like it came from a bot.  Called for
+ * every message as it arrives, before it is shown.
+ *
+ * Events are handled when their poll comes back, which can be long after
+ * they happened, so the timing rules only compare events from different
+ * batches.  Within one batch there is no telling how far apart they were.
+ */
+gboolean om_filter_is_spam(OmegleAccount *oma, OmegleSession *session,
+		const gchar *message)
+{
+	OmegleFilter *filter = oma->filter;
+	gint64 now;
+
+	if (filter == NULL)
+		return FALSE;
+
+	if (om_filter_match(filter, message))
+	{
+		purple_debug_info("omegle", "%s sent a spam phrase\n", session->id);
+		oma->stats.spam_matched++;
+		return TRUE;
+	}
+
+	now = g_get_monotonic_time();
+
+	/* Nobody types a long first message the instant they're connected */
+	if (session->messages_received == 0 && session->connected_time != 0 &&
+		session->connected_batch != session->batches &&
+		strlen(message) >= OM_FILTER_FAST_MIN_LEN &&
+		(gint64)strlen(message) * G_USEC_PER_SEC >
+			(now - session->connected_time) * OM_FILTER_FAST_MAX_CPS)
+	{
+		purple_debug_info("omegle", "%s typed too fast\n", session->id);
+		oma->stats.spam_too_fast++;
+		return TRUE;
+	}
+	session->messages_received++;
+
+	/* However many messages a batch holds, it counts once */
+	if (session->flood_batch == session->batches)
+		return FALSE;
+	session->flood_batch = session->batches;
+
+	if (now - session->flood_start > OM_FILTER_FLOOD_WINDOW * G_USEC_PER_SEC)
+	{
+		session->flood_start = now;
+		session->flood_count = 0;
+	}
+	if (++session->flood_count > OM_FILTER_FLOOD_COUNT)
+	{
+		purple_debug_info("omegle", "%s is flooding\n", session->id);
+		oma->stats.spam_flooded++;
+		return TRUE;
+	}
+
+	return FALSE;
+}
+
+void om_filter_destroy(OmegleAccount *oma)
+{
+	OmegleFilter *filter = oma->filter;
+
+	if (filter == NULL)
+		return;
+
+	g_hash_table_destroy(filter->edges);
+	g_array_free(filter->fail, TRUE);
+	g_array_free(filter->output, TRUE);
+	g_free(filter);
+	oma->filter = NULL;
+}
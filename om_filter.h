@@ -0,0 +1,38 @@
+/*
+ * libomegle
+ *
+ * libomegle is the property of its developers.  See the COPYRIGHT file
+ * for more details.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#ifndef OMEGLE_FILTER_H
+#define OMEGLE_FILTER_H
+
+#include "libomegle.h"
+
+#define OM_FILTER_MAX_STATES (1 << 22)
+#define OM_FILTER_FLOOD_COUNT 5
+#define OM_FILTER_FLOOD_WINDOW 3 /**< Seconds */
+#define OM_FILTER_FAST_MIN_LEN 40
+#define OM_FILTER_FAST_MAX_CPS 25 /**< Faster than anyone types */
+
+void om_filter_init(OmegleAccount *oma);
+gboolean om_filter_is_spam(OmegleAccount *oma, OmegleSession *session,
+		const gchar *message);
+void om_filter_destroy(OmegleAccount *oma);
+
+#endif /* OMEGLE_FILTER_H */
@@ -0,0 +1,538 @@
+/*
+ * libomegle
+ *
+ * libomegle is the property of its developers.  See the COPYRIGHT file
+ * for more details.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#include "om_log.h"
+#include "om_text.h"
+#include "om_worker.h"
+
+#include <glib/gstdio.h>
+#include <unistd.h>
+
+/*
+ * Every message sent or received is appended to a transcript file in
+ * the account's directory under purple_user_dir().  Two files are kept:
+ *
+ *   transcript.dat  OmegleLogRecords, each followed by the session id
+ *                   and the message text
+ *   transcript.idx  one OmegleLogIndexEntry per record, in the same order
+ *
+ * Records are collected on the main loop and written out in batches by
+ * a worker thread, so the disk is never touched from the main loop.
+ * Searching maps both files read-only, so even very large transcripts
+ * are never read into memory as a whole.
+ *
+ * There is no separate lookup by session id: an id: search walks the
+ * index comparing id_hash, which is a 32 bit compare per 24 byte entry
+ * over a mapped file, and only reads transcript.dat on a hash match.
+ * Keeping a second index sorted by id would cost a rewrite on every
+ * batch for a search that is rarely run.
+ */
+
+typedef struct _OmegleLogRecord OmegleLogRecord;
+typedef struct _OmegleLogIndexEntry OmegleLogIndexEntry;
+typedef struct _OmegleLogBatch OmegleLogBatch;
+
+struct _OmegleLogRecord {
+	guint32 length; /**< Of the whole record, header included */
+	guint8 direction;
+	guint8 id_len;
+	guint16 reserved;
+	gint64 time; /**< Wall clock, seconds */
+};
+
+struct _OmegleLogIndexEntry {
+	gint64 time;
+	guint64 offset; /**< Of the record in transcript.dat */
+	guint32 id_hash;
+	guint32 length;
+};
+
+/**
+ * Records waiting to be written.  Index offsets are relative to the start
+ * of data until the worker knows where the batch lands in the file.
+ */
+struct _OmegleLogBatch {
+	OmegleLog *log;
+	GString *data;
+	GArray *index; /**< OmegleLogIndexEntry */
+};
+
+struct _OmegleLog {
+	gchar *data_path;
+	gchar *index_path;
+	FILE *data_file; /**< Only touched by the worker thread */
+	FILE *index_file;
+	OmegleWorker *worker;
+	OmegleLogBatch *pending;
+	guint flush_timer;
+};
+
+static OmegleLogBatch *om_log_batch_new(OmegleLog *log)
+{
+	OmegleLogBatch *batch;
+
+	batch = g_new0(OmegleLogBatch, 1);
+	batch->log = log;
+	batch->data = g_string_sized_new(1024);
+	batch->index = g_array_new(FALSE, FALSE, sizeof(OmegleLogIndexEntry));
+
+	return batch;
+}
+
+static void om_log_batch_free(OmegleLogBatch *batch)
+{
+	g_string_free(batch->data, TRUE);
+	g_array_free(batch->index, TRUE);
+	g_free(batch);
+}
+
+/**
+ * Cuts off a partial entry left by a crash or a short write, which
+ * would otherwise misalign every entry appended after it
+ */
+static gboolean om_log_index_trim(const gchar *path)
+{
+	FILE *file;
+	long size;
+	gboolean ret = TRUE;
+
+	file = g_fopen(path, "r+b");
+	if (file == NULL)
+		return TRUE;
+
+	fseek(file, 0, SEEK_END);
+	size = ftell(file);
+	if (size < 0)
+		ret = FALSE;
+	else if (size % sizeof(OmegleLogIndexEntry) != 0)
+		ret = ftruncate(fileno(file),
+				size - size % sizeof(OmegleLogIndexEntry)) == 0;
+	fclose(file);
+
+	return ret;
+}
+
+/** Runs on the worker thread */
+static void om_log_batch_write(gpointer data)
+{
+	OmegleLogBatch *batch = data;
+	OmegleLog *log = batch->log;
+	OmegleLogIndexEntry *entry;
+	long base;
+	guint i;
+
+	if (log->data_file == NULL)
+		log->data_file = g_fopen(log->data_path, "ab");
+	if (log->index_file == NULL && om_log_index_trim(log->index_path))
+		log->index_file = g_fopen(log->index_path, "ab");
+	if (log->data_file == NULL || log->index_file == NULL)
+		return;
+
+	fseek(log->data_file, 0, SEEK_END);
+	base = ftell(log->data_file);
+	if (base < 0)
+		return;
+
+	for (i = 0; i < batch->index->len; i++)
+	{
+		entry = &g_array_index(batch->index, OmegleLogIndexEntry, i);
+		entry->offset += base;
+	}
+
+	/* The data goes first, so an index entry never points past the end */
+	if (fwrite(batch->data->str, 1, batch->data->len, log->data_file) !=
+			batch->data->len)
+		return;
+	fflush(log->data_file);
+
+	/* After a short write the file may end in a torn entry, and stdio
+	 * may still be holding part of it, so close it and let the next
+	 * batch trim it before appending */
+	if (fwrite(batch->index->data, sizeof(OmegleLogIndexEntry),
+			batch->index->len, log->index_file) != batch->index->len ||
+		fflush(log->index_file) != 0)
+	{
+		fclose(log->index_file);
+		log->index_file = NULL;
+	}
+}
+
+static gboolean om_log_flush_cb(gpointer data)
+{
+	OmegleAccount *oma = data;
+
+	oma->log->flush_timer = 0;
+	om_log_flush(oma);
+
+	return FALSE;
+}
+
+void om_log_init(OmegleAccount *oma)
+{
+	OmegleLog *log;
+	gchar *dir;
+
+	if (!purple_account_get_bool(oma->account, "transcripts", FALSE))
+		return;
+
+	dir = g_build_filename(purple_user_dir(), "omegle",
+			purple_escape_filename(purple_account_get_username(oma->account)),
+			NULL);
+	if (purple_build_dir(dir, S_IRUSR | S_IWUSR | S_IXUSR) != 0)
+	{
+		purple_debug_error("omegle", "could not create %s\n", dir);
+		g_free(dir);
+		return;
+	}
+
+	log = g_new0(OmegleLog, 1);
+	log->data_path = g_build_filename(dir, "transcript.dat", NULL);
+	log->index_path = g_build_filename(dir, "transcript.idx", NULL);
+	g_free(dir);
+	om_log_index_trim(log->index_path);
+
+	log->worker = om_worker_new(om_log_batch_write,
+			(OmegleWorkDoneFunc)om_log_batch_free,
+			(GDestroyNotify)om_log_batch_free);
+	if (log->worker == NULL)
+	{
+		g_free(log->data_path);
+		g_free(log->index_path);
+		g_free(log);
+		return;
+	}
+
+	oma->log = log;
+}
+
+static guint32 om_log_id_hash(const gchar *id, gsize len)
+{
+	guint32 hash = 5381;
+
+	while (len-- > 0)
+		hash = hash * 33 + (guchar)*id++;
+
+	return hash;
+}
+
+void om_log_append(OmegleAccount *oma, const gchar *id,
+		OmegleLogDirection direction, const gchar *message)
+{
+	OmegleLog *log = oma->log;
+	OmegleLogRecord record;
+	OmegleLogIndexEntry entry;
+	gsize id_len, message_len;
+
+	if (log == NULL || id == NULL || message == NULL)
+		return;
+
+	if (log->pending == NULL)
+		log->pending = om_log_batch_new(log);
+
+	id_len = MIN(strlen(id), G_MAXUINT8);
+	message_len = strlen(message);
+
+	memset(&record, 0, sizeof(record));
+	record.length = sizeof(record) + id_len + message_len;
+	record.direction = direction;
+	record.id_len = id_len;
+	record.time = time(NULL);
+
+	entry.time = record.time;
+	entry.offset = log->pending->data->len;
+	entry.id_hash = om_log_id_hash(id, id_len);
+	entry.length = record.length;
+
+	g_string_append_len(log->pending->data, (const gchar *)&record,
+			sizeof(record));
+	g_string_append_len(log->pending->data, id, id_len);
+	g_string_append_len(log->pending->data, message, message_len);
+	g_array_append_val(log->pending->index, entry);
+
+	if (log->pending->data->len >= OM_LOG_FLUSH_SIZE)
+		om_log_flush(oma);
+	else if (log->flush_timer == 0)
+		log->flush_timer = purple_timeout_add_seconds(OM_LOG_FLUSH_INTERVAL,
+				om_log_flush_cb, oma);
+}
+
+/**
+ * Hand whatever has been collected to the worker thread.
+ */
+void om_log_flush(OmegleAccount *oma)
+{
+	OmegleLog *log = oma->log;
+
+	if (log == NULL || log->pending == NULL)
+		return;
+
+	om_worker_push(log->worker, log->pending);
+	log->pending = NULL;
+}
+
+/**
+ * Find the first occurrence of needle in haystack, which unlike a string
+ * may contain NULs.
+ */
+static const gchar *om_log_memmem(const gchar *haystack, gsize haystack_len,
+		const gchar *needle, gsize needle_len)
+{
+	const gchar *p, *end;
+
+	if (needle_len == 0 || needle_len > haystack_len)
+		return NULL;
+
+	end = haystack + haystack_len - needle_len + 1;
+	for (p = haystack; p < end; p++)
+	{
+		p = memchr(p, needle[0], end - p);
+		if (p == NULL)
+			return NULL;
+		if (memcmp(p, needle, needle_len) == 0)
+			return p;
+	}
+
+	return NULL;
+}
+
+/**
+ * The index entry for the record that contains offset.
+ */
+static gssize om_log_index_lookup(const OmegleLogIndexEntry *index,
+		gsize entries, guint64 offset)
+{
+	gsize low = 0, high = entries;
+
+	while (low < high)
+	{
+		gsize mid = low + (high - low) / 2;
+		if (index[mid].offset <= offset)
+			low = mid + 1;
+		else
+			high = mid;
+	}
+
+	return (gssize)low - 1;
+}
+
+/** Records aren't aligned in the file, so they're always copied out */
+static void om_log_record_at(const gchar *data,
+		const OmegleLogIndexEntry *entry, OmegleLogRecord *record)
+{
+	memcpy(record, data + entry->offset, sizeof(*record));
+}
+
+/**
+ * The index entry has been checked against the file, the record inside
+ * it hasn't.  Everything after the header is sized by entry->length.
+ */
+static gboolean om_log_record_valid(const OmegleLogIndexEntry *entry,
+		const OmegleLogRecord *record)
+{
+	return record->id_len <= entry->length - sizeof(*record);
+}
+
+static void om_log_format_result(GString *results, const gchar *data,
+		const OmegleLogIndexEntry *entry)
+{
+	OmegleLogRecord record;
+	const gchar *id;
+	gchar *id_copy, *id_html, *message, *html;
+	time_t when;
+
+	om_log_record_at(data, entry, &record);
+	if (!om_log_record_valid(entry, &record))
+		return;
+	id = data + entry->offset + sizeof(record);
+
+	id_copy = g_strndup(id, record.id_len);
+	id_html = om_text_to_html(id_copy, FALSE);
+	message = g_strndup(id + record.id_len,
+			entry->length - sizeof(record) - record.id_len);
+	html = om_text_to_html(message, FALSE);
+	when = (time_t)record.time;
+
+	g_string_append_printf(results, "<b>%s</b> [%s] %s: %s<br>",
+			purple_utf8_strftime("%Y-%m-%d %H:%M:%S", localtime(&when)),
+			id_html, record.direction == OM_LOG_SENT ? "You" : "Stranger",
+			html);
+
+	g_free(html);
+	g_free(message);
+	g_free(id_html);
+	g_free(id_copy);
+}
+
+static gboolean om_log_entry_valid(const OmegleLogIndexEntry *entry,
+		gsize data_len)
+{
+	return entry->length >= sizeof(OmegleLogRecord) &&
+		entry->offset <= data_len && entry->length <= data_len - entry->offset;
+}
+
+static gboolean om_log_entry_has_id(const gchar *data,
+		const OmegleLogIndexEntry *entry, const gchar *id, guint32 id_hash)
+{
+	OmegleLogRecord record;
+
+	if (entry->id_hash != id_hash)
+		return FALSE;
+	om_log_record_at(data, entry, &record);
+	return om_log_record_valid(entry, &record) &&
+		record.id_len == strlen(id) &&
+		memcmp(data + entry->offset + sizeof(record), id, record.id_len) == 0;
+}
+
+/**
+ * Search the transcripts for messages containing query, newest matches
+ * last.  A query of the form "id:<session>" lists that whole session
+ * instead.  Returns HTML for display, or NULL if transcripts are off.
+ */
+gchar *om_log_search(OmegleAccount *oma, const gchar *query)
+{
+	OmegleLog *log = oma->log;
+	GMappedFile *data_map, *index_map;
+	const gchar *data, *hit;
+	const OmegleLogIndexEntry *index, *entry;
+	gsize data_len, entries, i, query_len;
+	gssize found;
+	OmegleLogRecord record;
+	GQueue *matches;
+	GString *results;
+	const gchar *session_id = NULL;
+	guint32 id_hash = 0;
+
+	if (log == NULL)
+		return NULL;
+
+	if (g_str_has_prefix(query, "id:"))
+	{
+		session_id = query + 3;
+		id_hash = om_log_id_hash(session_id, strlen(session_id));
+	}
+
+	/* Get the last few seconds onto disk too.  Searching doesn't wait
+	 * for it, so a search straight after a message may still miss it. */
+	om_log_flush(oma);
+
+	/* The index goes first; anything it lists is already in the data */
+	index_map = g_mapped_file_new(log->index_path, FALSE, NULL);
+	data_map = g_mapped_file_new(log->data_path, FALSE, NULL);
+	if (index_map == NULL || data_map == NULL)
+	{
+		if (index_map != NULL)
+			g_mapped_file_unref(index_map);
+		if (data_map != NULL)
+			g_mapped_file_unref(data_map);
+		return g_strdup("No transcripts have been written yet.");
+	}
+
+	index = (const OmegleLogIndexEntry *)g_mapped_file_get_contents(index_map);
+	entries = g_mapped_file_get_length(index_map) / sizeof(OmegleLogIndexEntry);
+	data = g_mapped_file_get_contents(data_map);
+	data_len = g_mapped_file_get_length(data_map);
+
+	/* Only the most recent OM_LOG_MAX_RESULTS are kept */
+	matches = g_queue_new();
+	if (session_id != NULL)
+	{
+		for (i = 0; i < entries; i++)
+		{
+			entry = &index[i];
+			if (!om_log_entry_valid(entry, data_len) ||
+				!om_log_entry_has_id(data, entry, session_id, id_hash))
+				continue;
+			g_queue_push_tail(matches, (gpointer)entry);
+			if (g_queue_get_length(matches) > OM_LOG_MAX_RESULTS)
+				g_queue_pop_head(matches);
+		}
+	} else {
+		/* Scan the whole file at once and work out afterwards which
+		 * record each hit is in, rather than visiting every record */
+		query_len = strlen(query);
+		hit = data;
+		while ((hit = om_log_memmem(hit, data_len - (hit - data),
+				query, query_len)) != NULL)
+		{
+			found = om_log_index_lookup(index, entries, hit - data);
+			if (found < 0)
+			{
+				hit++;
+				continue;
+			}
+			entry = &index[found];
+			if (!om_log_entry_valid(entry, data_len))
+			{
+				hit++;
+				continue;
+			}
+			om_log_record_at(data, entry, &record);
+			/* It has to be within the message, not the header or id */
+			if (hit + query_len <= data + entry->offset + entry->length &&
+				hit >= data + entry->offset + sizeof(record) + record.id_len)
+			{
+				g_queue_push_tail(matches, (gpointer)entry);
+				if (g_queue_get_length(matches) > OM_LOG_MAX_RESULTS)
+					g_queue_pop_head(matches);
+				/* One hit per record is enough */
+				hit = data + entry->offset + entry->length;
+			} else {
+				hit++;
+			}
+		}
+	}
+
+	results = g_string_new(NULL);
+	while ((entry = g_queue_pop_head(matches)) != NULL)
+		om_log_format_result(results, data, entry);
+	if (results->len == 0)
+		g_string_append(results, "Nothing found.");
+
+	g_queue_free(matches);
+	g_mapped_file_unref(index_map);
+	g_mapped_file_unref(data_map);
+
+	return g_string_free(results, FALSE);
+}
+
+void om_log_destroy(OmegleAccount *oma)
+{
+	OmegleLog *log = oma->log;
+
+	if (log == NULL)
+		return;
+
+	if (log->flush_timer)
+		purple_timeout_remove(log->flush_timer);
+	om_log_flush(oma);
+
+	/* Waits for the queued batches to be written */
+	om_worker_destroy(log->worker);
+	if (log->data_file != NULL)
+		fclose(log->data_file);
+	if (log->index_file != NULL)
+		fclose(log->index_file);
+
+	g_free(log->data_path);
+	g_free(log->index_path);
+	g_free(log);
+	oma->log = NULL;
+}
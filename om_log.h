@@ -0,0 +1,44 @@
+/*
+ * libomegle
+ *
+ * libomegle is the property of its developers.  See the COPYRIGHT file
+ * for more details.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#ifndef OMEGLE_LOG_H
+#define OMEGLE_LOG_H
+
+#include "libomegle.h"
+
+#define OM_LOG_FLUSH_INTERVAL 2 /**< Seconds between writes to disk */
+#define OM_LOG_FLUSH_SIZE (64 * 1024) /**< Write early past this much */
+#define OM_LOG_MAX_RESULTS 100
+
+typedef enum
+{
+	OM_LOG_RECEIVED = 0,
+	OM_LOG_SENT
+} OmegleLogDirection;
+
+void om_log_init(OmegleAccount *oma);
+void om_log_append(OmegleAccount *oma, const gchar *id,
+		OmegleLogDirection direction, const gchar *message);
+void om_log_flush(OmegleAccount *oma);
+gchar *om_log_search(OmegleAccount *oma, const gchar *query);
+void om_log_destroy(OmegleAccount *oma);
+
+#endif /* OMEGLE_LOG_H */
@@ -0,0 +1,174 @@
+/*
+ * libomegle
+ *
+ * libomegle is the property of its developers.  See the COPYRIGHT file
+ * for more details.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#define OM_PROFILE_INTERNAL
+#include "libomegle.h"
+
+#ifdef OM_ALLOC_PROFILE
+
+/* One more column than there are endpoints, for "none" */
+#define OM_PROFILE_ENDPOINTS (OM_RATE_CLASSES + 1)
+
+typedef struct _OmegleAllocCounter OmegleAllocCounter;
+
+struct _OmegleAllocCounter {
+	volatile gint calls;
+	volatile gint frees;
+	volatile gsize bytes; /**< Requested, not necessarily still held */
+};
+
+static OmegleAllocCounter om_profile_counters[OM_PHASES][OM_PROFILE_ENDPOINTS];
+static volatile gint om_profile_cycles;
+
+/** Phase and endpoint of the current thread, as slot + 1 */
+static GPrivate om_profile_slot = G_PRIVATE_INIT(NULL);
+
+static const gchar *om_phase_names[OM_PHASES] = {
+	"other", "request build", "receive", "gunzip", "parse", "dispatch"
+};
+static const gchar *om_endpoint_names[OM_PROFILE_ENDPOINTS] = {
+	"control", "send", "events", "typing", "none"
+};
+
+static OmegleAllocCounter *om_profile_counter(void)
+{
+	guint slot = GPOINTER_TO_UINT(g_private_get(&om_profile_slot));
+
+	if (slot == 0)
+		slot = OM_PROFILE_ENDPOINTS; /* OM_PHASE_OTHER, no endpoint */
+	slot--;
+
+	return &om_profile_counters[slot / OM_PROFILE_ENDPOINTS]
+			[slot % OM_PROFILE_ENDPOINTS];
+}
+
+static void om_profile_count(gsize n_bytes)
+{
+	OmegleAllocCounter *counter = om_profile_counter();
+
+	g_atomic_int_inc(&counter->calls);
+	g_atomic_pointer_add(&counter->bytes, n_bytes);
+}
+
+/**
+ * Put this thread's allocations down to phase and endpoint until the
+ * matching om_profile_leave().  Phases can nest.
+ */
+guint om_profile_enter(OmeglePhase phase, OmegleRateClass endpoint)
+{
+	guint previous = GPOINTER_TO_UINT(g_private_get(&om_profile_slot));
+
+	g_private_set(&om_profile_slot, GUINT_TO_POINTER(
+			phase * OM_PROFILE_ENDPOINTS + endpoint + 1));
+
+	return previous;
+}
+
+void om_profile_leave(guint previous)
+{
+	g_private_set(&om_profile_slot, GUINT_TO_POINTER(previous));
+}
+
+void om_profile_events_cycle(void)
+{
+	g_atomic_int_inc(&om_profile_cycles);
+}
+
+gpointer om_profile_malloc(gsize n_bytes)
+{
+	om_profile_count(n_bytes);
+	return g_malloc(n_bytes);
+}
+
+gpointer om_profile_malloc0(gsize n_bytes)
+{
+	om_profile_count(n_bytes);
+	return g_malloc0(n_bytes);
+}
+
+gpointer om_profile_realloc(gpointer mem, gsize n_bytes)
+{
+	om_profile_count(n_bytes);
+	return g_realloc(mem, n_bytes);
+}
+
+void om_profile_free(gpointer mem)
+{
+	if (mem != NULL)
+		g_atomic_int_inc(&om_profile_counter()->frees);
+	g_free(mem);
+}
+
+/** For allocators that are only wrapped after the fact */
+gpointer om_profile_note(gpointer mem, gsize n_bytes)
+{
+	if (mem != NULL)
+		om_profile_count(n_bytes);
+	return mem;
+}
+
+gchar *om_profile_note_string(gchar *str)
+{
+	if (str != NULL)
+		om_profile_count(strlen(str) + 1);
+	return str;
+}
+
+/**
+ * Everything counted so far, as HTML.  The /events endpoint is also
+ * shown per poll cycle, which is where the steady state cost is.
+ */
+gchar *om_profile_report(void)
+{
+	GString *report;
+	OmegleAllocCounter *counter;
+	guint phase, endpoint;
+	gint cycles;
+
+	cycles = g_atomic_int_get(&om_profile_cycles);
+
+	report = g_string_new(NULL);
+	g_string_append_printf(report, "<b>/events cycles:</b> %d<br><br>", cycles);
+
+	for (phase = 0; phase < OM_PHASES; phase++)
+	{
+		for (endpoint = 0; endpoint < OM_PROFILE_ENDPOINTS; endpoint++)
+		{
+			counter = &om_profile_counters[phase][endpoint];
+			if (counter->calls == 0 && counter->frees == 0)
+				continue;
+
+			g_string_append_printf(report,
+					"<b>%s, %s:</b> %d allocations, %" G_GSIZE_FORMAT " bytes, %d frees",
+					om_phase_names[phase], om_endpoint_names[endpoint],
+					counter->calls, counter->bytes, counter->frees);
+			if (endpoint == OM_RATE_EVENTS && cycles > 0)
+				g_string_append_printf(report,
+						" (%d allocations, %" G_GSIZE_FORMAT " bytes per cycle)",
+						counter->calls / cycles, counter->bytes / cycles);
+			g_string_append(report, "<br>");
+		}
+	}
+
+	return g_string_free(report, FALSE);
+}
+
+#endif /* OM_ALLOC_PROFILE */
@@ -0,0 +1,82 @@
+/*
+ * libomegle
+ *
+ * libomegle is the property of its developers.  See the COPYRIGHT file
+ * for more details.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#ifndef OMEGLE_PROFILE_H
+#define OMEGLE_PROFILE_H
+
+/*
+ * Allocation profiling, for builds made with "make ALLOC_PROFILE=1".
+ *
+ * The plugin's own calls to the glib allocators are counted, and each
+ * one is put down to whatever phase of a request the calling thread
+ * was in and to the endpoint the request was for.  Allocations made
+ * inside glib or json-glib themselves aren't seen.  In normal builds
+ * all of this compiles away.
+ */
+
+typedef enum
+{
+	OM_PHASE_OTHER = 0,
+	OM_PHASE_BUILD,
+	OM_PHASE_RECEIVE,
+	OM_PHASE_GUNZIP,
+	OM_PHASE_PARSE,
+	OM_PHASE_DISPATCH,
+	OM_PHASES
+} OmeglePhase;
+
+#ifdef OM_ALLOC_PROFILE
+
+guint om_profile_enter(OmeglePhase phase, OmegleRateClass endpoint);
+void om_profile_leave(guint previous);
+void om_profile_events_cycle(void);
+gchar *om_profile_report(void);
+
+gpointer om_profile_malloc(gsize n_bytes);
+gpointer om_profile_malloc0(gsize n_bytes);
+gpointer om_profile_realloc(gpointer mem, gsize n_bytes);
+void om_profile_free(gpointer mem);
+gpointer om_profile_note(gpointer mem, gsize n_bytes);
+gchar *om_profile_note_string(gchar *str);
+
+#ifndef OM_PROFILE_INTERNAL
+#	define g_malloc(n) om_profile_malloc(n)
+#	define g_malloc0(n) om_profile_malloc0(n)
+#	define g_malloc_n(n, size) om_profile_malloc((n) * (size))
+#	define g_malloc0_n(n, size) om_profile_malloc0((n) * (size))
+#	define g_realloc(mem, n) om_profile_realloc(mem, n)
+#	define g_realloc_n(mem, n, size) om_profile_realloc(mem, (n) * (size))
+#	define g_free(mem) om_profile_free(mem)
+#	define g_strdup(str) om_profile_note_string(g_strdup(str))
+#	define g_strndup(str, n) om_profile_note_string(g_strndup(str, n))
+#	define g_strdup_printf(...) om_profile_note_string(g_strdup_printf(__VA_ARGS__))
+#	define g_memdup(mem, n) om_profile_note(g_memdup(mem, n), n)
+#endif
+
+#else
+
+#define om_profile_enter(phase, endpoint) 0
+#define om_profile_leave(previous) ((void)(previous))
+#define om_profile_events_cycle()
+
+#endif /* OM_ALLOC_PROFILE */
+
+#endif /* OMEGLE_PROFILE_H */
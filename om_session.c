@@ -0,0 +1,1445 @@
+/*
+ * libomegle
+ *
+ * libomegle is the property of its developers.  See the COPYRIGHT file
+ * for more details.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "om_session.h"
+#include "om_filter.h"
+#include "om_log.h"
+#include "om_text.h"
+
+#include <json-glib/json-glib.h>
+
+static gpointer om_events_parse(const gchar *response, gsize len);
+static void om_got_events(OmegleAccount *oma, gpointer parsed,
+		gpointer userdata);
+static void om_stream_events(OmegleAccount *oma, gpointer parsed,
+		gpointer userdata);
+static void om_event_batch_free(OmegleEventBatch *batch);
+static void om_hedge_check(OmegleHedge *hedge);
+static gboolean om_session_dispatch_event(OmegleSession *session,
+		const gchar *event_type, const gchar *message);
+static void om_poll_run(OmegleAccount *oma);
+static void om_session_ui_flush(OmegleSession *session);
+static void om_session_ui_discard(OmegleSession *session);
+
+static void om_event_free(OmegleEvent *event)
+{
+	g_free(event->type);
+	g_free(event->message);
+	g_free(event);
+}
+
+static OmegleSession *om_session_new(OmegleAccount *oma, const gchar *host)
+{
+	OmegleSession *session;
+
+	session = g_new0(OmegleSession, 1);
+	session->oma = oma;
+	session->host = g_strdup(host);
+	session->state = OM_SESSION_STARTING;
+	session->start_time = g_get_monotonic_time();
+
+	return session;
+}
+
+static void om_session_cancel_poll(OmegleSession *session)
+{
+	OmegleAccount *oma = session->oma;
+
+	if (session->poll_timer)
+	{
+		purple_timeout_remove(session->poll_timer);
+		session->poll_timer = 0;
+	}
+	if (session->poll_queued)
+	{
+		oma->poll_queue = g_slist_remove(oma->poll_queue, session);
+		session->poll_queued = FALSE;
+	}
+	/* om_session_poll_lost clears poll_conn and gives back its slot */
+	if (session->poll_conn != NULL)
+		om_connection_destroy(session->poll_conn);
+}
+
+/**
+ * Free a session.  This is the value destroy function of oma->sessions,
+ * so it must not remove the session from that table itself.
+ */
+static void om_session_free(OmegleSession *session)
+{
+	if (session->hedge != NULL)
+		session->hedge->candidates =
+				g_slist_remove(session->hedge->candidates, session);
+	if (session->standby)
+		session->oma->standby = g_slist_remove(session->oma->standby, session);
+	if (session->backlog != NULL)
+		g_queue_free_full(session->backlog, (GDestroyNotify)om_event_free);
+	if (session->ui_queued)
+		session->oma->ui_pending =
+				g_slist_remove(session->oma->ui_pending, session);
+	if (session->ui_messages != NULL)
+		g_string_free(session->ui_messages, TRUE);
+
+	om_session_cancel_poll(session);
+
+	g_free(session->id);
+	g_free(session->host);
+	g_free(session);
+}
+
+/**
+ * Drop a session we no longer want without telling the server.
+ */
+static void om_session_release(OmegleSession *session)
+{
+	OmegleAccount *oma = session->oma;
+	OmegleHedge *hedge = session->hedge;
+
+	/* Let the user see whatever was still held back */
+	om_session_ui_flush(session);
+
+	if (session->id != NULL)
+	{
+		g_hash_table_remove(oma->sessions, session->id);
+	} else {
+		oma->pending_sessions =
+				g_slist_remove(oma->pending_sessions, session);
+		om_session_free(session);
+	}
+
+	if (hedge != NULL)
+		om_hedge_check(hedge);
+
+	/* That may have freed up a polling slot */
+	om_poll_run(oma);
+}
+
+OmegleSession *om_session_find(OmegleAccount *oma, const gchar *id)
+{
+	g_return_val_if_fail(id != NULL, NULL);
+
+	return g_hash_table_lookup(oma->sessions, id);
+}
+
+const gchar *om_session_host(OmegleAccount *oma, const gchar *id)
+{
+	OmegleSession *session;
+
+	session = om_session_find(oma, id);
+	if (session == NULL)
+		return NULL;
+
+	return session->host;
+}
+
+void om_session_disconnect(OmegleAccount *oma, const gchar *id)
+{
+	OmegleSession *session;
+	GString *postdata;
+
+	session = om_session_find(oma, id);
+
+	postdata = g_string_sized_new(64);
+	om_form_append(postdata, "id", id);
+	om_post_or_get(oma, OM_METHOD_POST, session ? session->host : NULL,
+			"/disconnect", postdata, NULL, NULL);
+	g_string_free(postdata, TRUE);
+
+	if (session != NULL)
+		om_session_release(session);
+}
+
+/**
+ * The user closed the conversation window.  Anything held back for it
+ * is thrown away, as showing it would only open the window again.
+ */
+void om_session_close(OmegleAccount *oma, const gchar *id)
+{
+	OmegleSession *session;
+
+	session = om_session_find(oma, id);
+	if (session != NULL)
+		om_session_ui_discard(session);
+
+	om_session_disconnect(oma, id);
+}
+
+/**
+ * Tell the server we're leaving every conversation, all at once.  This
+ * is for when the account closes, so the sessions themselves are left
+ * for om_sessions_destroy.
+ */
+void om_sessions_disconnect_all(OmegleAccount *oma)
+{
+	GHashTableIter iter;
+	OmegleSession *session;
+	GString *postdata;
+
+	postdata = g_string_sized_new(64);
+
+	g_hash_table_iter_init(&iter, oma->sessions);
+	while (g_hash_table_iter_next(&iter, NULL, (gpointer *)&session))
+	{
+		/* The server already knows about these */
+		if (session->state == OM_SESSION_DISCONNECTED)
+			continue;
+
+		g_string_truncate(postdata, 0);
+		om_form_append(postdata, "id", session->id);
+		om_post_or_get(oma, OM_METHOD_POST, session->host, "/disconnect",
+				postdata, NULL, NULL);
+	}
+
+	g_string_free(postdata, TRUE);
+}
+
+void om_session_touch(OmegleAccount *oma, const gchar *id)
+{
+	OmegleSession *session;
+
+	session = om_session_find(oma, id);
+	if (session != NULL)
+		session->last_activity = g_get_monotonic_time();
+}
+
+/******************************************************************************/
+/* Poll scheduler */
+/******************************************************************************/
+
+/*
+ * Every session's /events request goes through here rather than being
+ * chained straight from the previous response.  At most "max_polls"
+ * are in flight per account; the rest wait in oma->poll_queue and the
+ * most recently active conversation goes first when a slot frees up.
+ */
+
+/**
+ * The poll was destroyed before it came back, by us or by a connection
+ * error, and will never reach om_got_events.
+ */
+static void om_session_poll_lost(gpointer data)
+{
+	OmegleSession *session = data;
+
+	session->poll_conn = NULL;
+	session->oma->polls_active--;
+}
+
+static void om_session_fetch_events(OmegleSession *session)
+{
+	OmegleAccount *oma = session->oma;
+	GString *postdata;
+	gboolean stream;
+
+	postdata = g_string_sized_new(64);
+	om_form_append(postdata, "id", session->id);
+
+	stream = purple_account_get_bool(oma->account, "stream_events", FALSE);
+	session->poll_conn = om_post_or_get(oma,
+			stream ? OM_METHOD_POST | OM_METHOD_STREAM : OM_METHOD_POST,
+			session->host, "/events", postdata, NULL, session);
+	om_connection_set_parser(session->poll_conn, om_events_parse,
+			om_got_events, (GDestroyNotify)om_event_batch_free);
+	if (stream)
+		om_connection_set_stream(session->poll_conn, om_stream_events);
+	om_connection_set_lost_func(session->poll_conn, om_session_poll_lost);
+	oma->polls_active++;
+	if (oma->polls_active > oma->stats.polls_peak)
+		oma->stats.polls_peak = oma->polls_active;
+
+	g_string_free(postdata, TRUE);
+}
+
+static void om_poll_run(OmegleAccount *oma)
+{
+	OmegleSession *next;
+	GSList *l;
+	gint max_polls;
+
+	if (oma->account->disconnecting || oma->network_down)
+		return;
+
+	max_polls = purple_account_get_int(oma->account, "max_polls",
+			OM_DEFAULT_MAX_POLLS);
+	if (max_polls < 1)
+		max_polls = 1;
+
+	while (oma->poll_queue != NULL && (gint)oma->polls_active < max_polls)
+	{
+		if (om_connection_over_budget(oma))
+		{
+			/* Started again once enough responses have been dealt with */
+			oma->stats.polls_paused++;
+			break;
+		}
+
+		next = oma->poll_queue->data;
+		for (l = oma->poll_queue->next; l; l = l->next)
+		{
+			OmegleSession *session = l->data;
+			if (session->last_activity > next->last_activity)
+				next = session;
+		}
+
+		oma->poll_queue = g_slist_remove(oma->poll_queue, next);
+		next->poll_queued = FALSE;
+		om_session_fetch_events(next);
+	}
+}
+
+static void om_session_queue_poll(OmegleSession *session)
+{
+	OmegleAccount *oma = session->oma;
+
+	if (session->poll_conn != NULL || session->poll_queued)
+		return;
+
+	session->poll_queued = TRUE;
+	oma->poll_queue = g_slist_append(oma->poll_queue, session);
+	om_poll_run(oma);
+
+	if (session->poll_queued)
+		oma->stats.polls_deferred++;
+}
+
+static gboolean om_session_poll_timeout(gpointer data)
+{
+	OmegleSession *session = data;
+
+	session->poll_timer = 0;
+	om_session_queue_poll(session);
+
+	return FALSE;
+}
+
+/**
+ * Poll again after a response that brought nothing useful, waiting a
+ * little longer each time it happens in a row.
+ */
+static void om_session_poll_backoff(OmegleSession *session)
+{
+	guint delay;
+
+	session->empty_polls++;
+	session->oma->stats.poll_backoffs++;
+
+	delay = OM_POLL_BACKOFF_MIN << MIN(session->empty_polls - 1, 16);
+	if (delay > OM_POLL_BACKOFF_MAX)
+		delay = OM_POLL_BACKOFF_MAX;
+
+	if (session->poll_timer == 0)
+		session->poll_timer = purple_timeout_add(delay,
+				om_session_poll_timeout, session);
+}
+
+static gboolean om_poll_kick_cb(gpointer data)
+{
+	OmegleAccount *oma = data;
+
+	oma->poll_kick_timer = 0;
+	om_poll_run(oma);
+
+	return FALSE;
+}
+
+/**
+ * Run the poll queue soon, from the main loop rather than from whatever
+ * is calling us.
+ */
+void om_poll_kick(OmegleAccount *oma)
+{
+	if (oma->poll_kick_timer == 0 && oma->sessions != NULL)
+		oma->poll_kick_timer = purple_timeout_add(0, om_poll_kick_cb, oma);
+}
+
+/**
+ * Pick up any session that has ended up with no poll in flight, queued
+ * or waiting on a timer.
+ */
+static gboolean om_poll_watchdog(gpointer data)
+{
+	OmegleAccount *oma = data;
+	GHashTableIter iter;
+	OmegleSession *session;
+
+	/* Everything is parked on purpose */
+	if (oma->network_down)
+		return TRUE;
+
+	g_hash_table_iter_init(&iter, oma->sessions);
+	while (g_hash_table_iter_next(&iter, NULL, (gpointer *)&session))
+	{
+		if (session->poll_conn == NULL && !session->poll_queued &&
+			session->poll_timer == 0)
+		{
+			purple_debug_warning("omegle", "restarting stranded poll for %s\n",
+					session->id);
+			oma->stats.poll_restarts++;
+			session->poll_queued = TRUE;
+			oma->poll_queue = g_slist_append(oma->poll_queue, session);
+		}
+	}
+	om_poll_run(oma);
+
+	return TRUE;
+}
+
+/******************************************************************************/
+/* Network recovery */
+/******************************************************************************/
+
+/*
+ * Losing the network used to take the whole account down with it, and
+ * every stranger along with it, though the server would have kept their
+ * sessions for a while yet.  Now a request that can't reach the server
+ * parks the account instead: polls stop, each session waits in the
+ * poll queue with its id, and polling picks up again once the network
+ * is back.  Only a session the server then says it has forgotten, by
+ * answering "null", is given up.
+ */
+
+static void om_sessions_network_resume(OmegleAccount *oma)
+{
+	GHashTableIter iter;
+	OmegleSession *session;
+
+	purple_debug_info("omegle", "network is back, resuming %u sessions\n",
+			g_hash_table_size(oma->sessions));
+
+	oma->network_down = FALSE;
+	oma->recovery_attempts++;
+
+	g_hash_table_iter_init(&iter, oma->sessions);
+	while (g_hash_table_iter_next(&iter, NULL, (gpointer *)&session))
+	{
+		/* Any poll still out was sent before the outage and may be
+		 * hanging on a dead socket */
+		if (session->poll_conn != NULL)
+			om_session_cancel_poll(session);
+		session->resumed = TRUE;
+		if (!session->poll_queued && session->poll_timer == 0)
+		{
+			session->poll_queued = TRUE;
+			oma->poll_queue = g_slist_append(oma->poll_queue, session);
+		}
+	}
+
+	om_poll_run(oma);
+}
+
+static gboolean om_sessions_recovery_check(gpointer data)
+{
+	OmegleAccount *oma = data;
+	guint delay;
+
+	oma->recovery_timer = 0;
+
+	if (g_get_monotonic_time() - oma->network_lost_time >
+			(gint64)OM_RECOVERY_TIMEOUT * G_USEC_PER_SEC)
+	{
+		/* The server will have given up on us by now */
+		purple_connection_error_reason(oma->pc,
+				PURPLE_CONNECTION_ERROR_NETWORK_ERROR,
+				_("Lost the connection to the server."));
+		return FALSE;
+	}
+
+	if (purple_network_is_available())
+	{
+		om_sessions_network_resume(oma);
+		return FALSE;
+	}
+
+	delay = OM_RECOVERY_RETRY_MIN << MIN(oma->recovery_attempts, 16);
+	if (delay > OM_RECOVERY_RETRY_MAX)
+		delay = OM_RECOVERY_RETRY_MAX;
+	oma->recovery_timer = purple_timeout_add(delay,
+			om_sessions_recovery_check, oma);
+
+	return FALSE;
+}
+
+static void om_sessions_network_changed_cb(void *data)
+{
+	OmegleAccount *oma = data;
+
+	/* Don't wait out the rest of the retry delay */
+	if (oma->network_down && oma->recovery_timer != 0)
+	{
+		purple_timeout_remove(oma->recovery_timer);
+		oma->recovery_timer = purple_timeout_add(0,
+				om_sessions_recovery_check, oma);
+	}
+}
+
+/**
+ * Called when a request couldn't reach the server at all.  Returns
+ * TRUE if the account is going to wait for the network to come back,
+ * FALSE if the caller should treat the error as fatal.
+ */
+gboolean om_sessions_network_lost(OmegleAccount *oma)
+{
+	GHashTableIter iter;
+	OmegleSession *session;
+	guint delay;
+	gint64 now;
+
+	if (oma->account->disconnecting || oma->sessions == NULL ||
+			g_hash_table_size(oma->sessions) == 0)
+		return FALSE;
+
+	if (oma->network_down)
+		return TRUE;
+
+	now = g_get_monotonic_time();
+	if (oma->network_lost_time == 0)
+	{
+		oma->network_lost_time = now;
+		oma->recovery_attempts = 0;
+	} else if (now - oma->network_lost_time >
+			(gint64)OM_RECOVERY_TIMEOUT * G_USEC_PER_SEC) {
+		/* Still failing after all this time, it isn't coming back */
+		return FALSE;
+	}
+
+	purple_debug_warning("omegle", "lost the network, parking %u sessions\n",
+			g_hash_table_size(oma->sessions));
+
+	oma->network_down = TRUE;
+	oma->stats.network_losses++;
+
+	g_hash_table_iter_init(&iter, oma->sessions);
+	while (g_hash_table_iter_next(&iter, NULL, (gpointer *)&session))
+	{
+		if (!session->standby && session->state == OM_SESSION_CONNECTED)
+		{
+			om_session_ui_flush(session);
+			serv_got_im(oma->pc, session->id, "Lost the connection to Omegle, trying to get it back...", PURPLE_MESSAGE_SYSTEM, time(NULL));
+		}
+	}
+
+	delay = OM_RECOVERY_RETRY_MIN << MIN(oma->recovery_attempts, 16);
+	if (delay > OM_RECOVERY_RETRY_MAX)
+		delay = OM_RECOVERY_RETRY_MAX;
+	if (oma->recovery_timer == 0)
+		oma->recovery_timer = purple_timeout_add(delay,
+				om_sessions_recovery_check, oma);
+
+	return TRUE;
+}
+
+/**
+ * Park a session whose poll failed because the network went away.
+ * It is polled again when om_sessions_network_resume runs.
+ */
+static void om_session_park(OmegleSession *session)
+{
+	OmegleAccount *oma = session->oma;
+
+	if (session->poll_queued || session->poll_timer != 0)
+		return;
+
+	session->poll_queued = TRUE;
+	oma->poll_queue = g_slist_append(oma->poll_queue, session);
+}
+
+/******************************************************************************/
+/* Hedged start */
+/******************************************************************************/
+
+static void om_hedge_free(OmegleHedge *hedge)
+{
+	GSList *l;
+
+	if (hedge->timer)
+		purple_timeout_remove(hedge->timer);
+
+	for (l = hedge->candidates; l; l = l->next)
+	{
+		OmegleSession *session = l->data;
+		session->hedge = NULL;
+	}
+	g_slist_free(hedge->candidates);
+
+	hedge->oma->hedges = g_slist_remove(hedge->oma->hedges, hedge);
+	g_strfreev(hedge->hosts);
+	g_free(hedge);
+}
+
+/**
+ * Free the hedge once nothing can happen to it any more: either a winner
+ * was picked or every candidate died, and no /start is still in flight.
+ */
+static void om_hedge_check(OmegleHedge *hedge)
+{
+	if (hedge->outstanding > 0)
+		return;
+
+	if (hedge->won || (hedge->candidates == NULL && hedge->timer == 0))
+		om_hedge_free(hedge);
+}
+
+/**
+ * The first stranger since login, which is what a warm start is meant
+ * to bring forward.
+ */
+static void om_session_first_match(OmegleAccount *oma)
+{
+	if (oma->stats.first_match_usec == 0)
+		oma->stats.first_match_usec = g_get_monotonic_time() - oma->login_time;
+}
+
+static void om_hedge_won(OmegleHedge *hedge, OmegleSession *winner)
+{
+	OmegleAccount *oma = hedge->oma;
+	GSList *losers, *l;
+
+	hedge->won = TRUE;
+	if (hedge->timer)
+	{
+		purple_timeout_remove(hedge->timer);
+		hedge->timer = 0;
+	}
+
+	oma->stats.hedged_matches++;
+	oma->stats.hedged_match_usec += g_get_monotonic_time() - hedge->start_time;
+	om_session_first_match(oma);
+	if (!g_str_equal(winner->host, hedge->hosts[0]))
+		oma->stats.hedge_secondary_wins++;
+
+	hedge->candidates = g_slist_remove(hedge->candidates, winner);
+	winner->hedge = NULL;
+
+	/* Candidates without an id yet get disconnected when their /start
+	 * comes back, the rest we can drop straight away */
+	losers = NULL;
+	for (l = hedge->candidates; l; l = l->next)
+	{
+		OmegleSession *session = l->data;
+		if (session->id != NULL)
+			losers = g_slist_prepend(losers, session);
+	}
+	for (l = losers; l; l = l->next)
+	{
+		OmegleSession *session = l->data;
+		hedge->candidates = g_slist_remove(hedge->candidates, session);
+		session->hedge = NULL;
+		oma->stats.hedge_losers++;
+		om_session_disconnect(oma, session->id);
+	}
+	g_slist_free(losers);
+
+	om_hedge_check(hedge);
+}
+
+static void om_session_start_cb(OmegleAccount *oma, gchar *response,
+		gsize len, gpointer userdata)
+{
+	OmegleSession *session = userdata;
+	OmegleHedge *hedge = session->hedge;
+
+	oma->pending_sessions = g_slist_remove(oma->pending_sessions, session);
+	if (hedge != NULL)
+		hedge->outstanding--;
+
+	if (!response || !*response || g_str_equal(response, "null"))
+	{
+		purple_debug_error("omegle", "no session id from %s\n",
+				session->host);
+		om_session_free(session);
+		if (hedge != NULL)
+			om_hedge_check(hedge);
+		return;
+	}
+
+	//This should come back with an ID that we pass around
+	session->id = g_strdup(response);
+	purple_str_strip_char(session->id, '"');
+	session->state = OM_SESSION_WAITING;
+	g_hash_table_replace(oma->sessions, session->id, session);
+
+	if (hedge != NULL && hedge->won)
+	{
+		/* Somebody else got there first */
+		session->hedge = NULL;
+		hedge->candidates = g_slist_remove(hedge->candidates, session);
+		oma->stats.hedge_losers++;
+		om_session_disconnect(oma, session->id);
+		om_hedge_check(hedge);
+		return;
+	}
+
+	//Start the event loop
+	session->last_activity = g_get_monotonic_time();
+	om_session_queue_poll(session);
+}
+
+static OmegleSession *om_session_send_start(OmegleAccount *oma,
+		const gchar *host, OmegleHedge *hedge)
+{
+	OmegleSession *session;
+	OmegleConnection *omconn;
+
+	session = om_session_new(oma, host);
+	session->hedge = hedge;
+	if (hedge != NULL)
+	{
+		hedge->candidates = g_slist_prepend(hedge->candidates, session);
+		hedge->outstanding++;
+	}
+	oma->pending_sessions = g_slist_prepend(oma->pending_sessions, session);
+
+	omconn = om_post_or_get(oma, OM_METHOD_POST, host, "/start",
+			NULL, om_session_start_cb, session);
+	/* One dead server among several only loses its own candidate */
+	if (hedge != NULL)
+		om_connection_set_expendable(omconn);
+
+	return session;
+}
+
+static gboolean om_hedge_timeout(gpointer data)
+{
+	OmegleHedge *hedge = data;
+
+	om_session_send_start(hedge->oma, hedge->hosts[hedge->next_host++],
+			hedge);
+
+	if (hedge->next_host >= hedge->hosts_len)
+	{
+		hedge->timer = 0;
+		return FALSE;
+	}
+	return TRUE;
+}
+
+/**
+ * Work out which servers a hedged start should use.  The configured
+ * server always goes first, followed by the "hedge_hosts" list.
+ */
+gchar **om_session_hosts(OmegleAccount *oma, guint *len)
+{
+	GPtrArray *hosts;
+	gchar **extra;
+	guint i, j;
+
+	hosts = g_ptr_array_new();
+	g_ptr_array_add(hosts, g_strdup(purple_account_get_string(oma->account,
+			"host", "bajor.omegle.com")));
+
+	extra = g_strsplit(purple_account_get_string(oma->account,
+			"hedge_hosts", ""), ",", -1);
+	for (i = 0; extra[i]; i++)
+	{
+		gchar *host = g_strstrip(extra[i]);
+		if (!*host)
+			continue;
+		for (j = 0; j < hosts->len; j++)
+			if (g_ascii_strcasecmp(host, g_ptr_array_index(hosts, j)) == 0)
+				break;
+		if (j == hosts->len)
+			g_ptr_array_add(hosts, g_strdup(host));
+	}
+	g_strfreev(extra);
+
+	*len = hosts->len;
+	g_ptr_array_add(hosts, NULL);
+
+	return (gchar **)g_ptr_array_free(hosts, FALSE);
+}
+
+/******************************************************************************/
+/* Standby pool */
+/******************************************************************************/
+
+static gboolean om_standby_check(gpointer data)
+{
+	OmegleAccount *oma = data;
+	GSList *expired, *l;
+	gint64 idle, now;
+
+	if (purple_account_get_int(oma->account, "standby_pool", 0) <= 0)
+	{
+		/* Turned off while we were running, let what's left drain */
+		oma->standby_timer = 0;
+		return FALSE;
+	}
+
+	idle = (gint64)purple_account_get_int(oma->account, "standby_idle", 60) *
+			G_USEC_PER_SEC;
+
+	now = g_get_monotonic_time();
+	expired = NULL;
+	for (l = oma->standby; l; l = l->next)
+	{
+		OmegleSession *session = l->data;
+
+		if (session->id == NULL)
+			continue;
+		/* A real stranger is talking to nobody, so they're let go
+		 * much sooner than a session that is still waiting */
+		if (session->state == OM_SESSION_CONNECTED ?
+				now - session->connected_time >
+					(gint64)OM_STANDBY_MATCHED_MAX * G_USEC_PER_SEC :
+				now - session->start_time > idle)
+		{
+			expired = g_slist_prepend(expired, session);
+		}
+	}
+	for (l = expired; l; l = l->next)
+	{
+		OmegleSession *session = l->data;
+		oma->stats.standby_expired++;
+		om_session_disconnect(oma, session->id);
+	}
+	g_slist_free(expired);
+
+	om_standby_refill(oma);
+
+	return TRUE;
+}
+
+void om_standby_refill(OmegleAccount *oma)
+{
+	OmegleSession *session;
+	const gchar *host;
+	gint size;
+
+	if (oma->account->disconnecting)
+		return;
+
+	size = purple_account_get_int(oma->account, "standby_pool", 0);
+	if (size > OM_STANDBY_MAX_POOL)
+		size = OM_STANDBY_MAX_POOL;
+	if (size <= 0)
+		return;
+
+	host = purple_account_get_string(oma->account, "host", "bajor.omegle.com");
+	while ((gint)g_slist_length(oma->standby) < size)
+	{
+		session = om_session_send_start(oma, host, NULL);
+		session->standby = TRUE;
+		oma->standby = g_slist_prepend(oma->standby, session);
+	}
+
+	if (oma->standby_timer == 0)
+		oma->standby_timer = purple_timeout_add_seconds(
+				OM_STANDBY_CHECK_INTERVAL, om_standby_check, oma);
+}
+
+/**
+ * Hand one of the standby sessions to the user, preferring one that has
+ * already been matched with a stranger.
+ */
+static gboolean om_standby_claim(OmegleAccount *oma)
+{
+	OmegleSession *session = NULL;
+	OmegleEvent *event;
+	GSList *l;
+
+	for (l = oma->standby; l; l = l->next)
+	{
+		OmegleSession *candidate = l->data;
+		if (candidate->state == OM_SESSION_CONNECTED)
+		{
+			session = candidate;
+			break;
+		}
+		if (candidate->id != NULL && (session == NULL ||
+				candidate->start_time < session->start_time))
+			session = candidate;
+	}
+	if (session == NULL && oma->standby != NULL)
+		session = oma->standby->data;
+	if (session == NULL)
+		return FALSE;
+
+	oma->standby = g_slist_remove(oma->standby, session);
+	session->standby = FALSE;
+	oma->stats.standby_claims++;
+
+	/* From the user's point of view the wait starts now */
+	session->start_time = g_get_monotonic_time();
+	if (session->id == NULL)
+		return TRUE;
+
+	if (session->state == OM_SESSION_CONNECTED)
+	{
+		oma->stats.standby_instant_matches++;
+		/* Let the buffered "connected" be counted and shown as usual */
+		session->state = OM_SESSION_WAITING;
+	} else {
+		serv_got_im(oma->pc, session->id, "Looking for someone you can chat with. Hang on.", PURPLE_MESSAGE_SYSTEM, time(NULL));
+	}
+
+	while (session->backlog != NULL &&
+		(event = g_queue_pop_head(session->backlog)) != NULL)
+	{
+		om_session_dispatch_event(session, event->type, event->message);
+		om_event_free(event);
+	}
+
+	return TRUE;
+}
+
+void om_session_start(OmegleAccount *oma)
+{
+	OmegleHedge *hedge;
+	gchar **hosts;
+	guint hosts_len;
+	gint count, delay;
+
+	if (om_standby_claim(oma))
+	{
+		om_standby_refill(oma);
+		return;
+	}
+
+	hosts = om_session_hosts(oma, &hosts_len);
+	count = purple_account_get_int(oma->account, "hedge_count", 1);
+	if (count > (gint)hosts_len)
+		count = hosts_len;
+
+	if (count <= 1)
+	{
+		om_session_send_start(oma, hosts[0], NULL);
+		g_strfreev(hosts);
+		return;
+	}
+
+	hedge = g_new0(OmegleHedge, 1);
+	hedge->oma = oma;
+	hedge->hosts = hosts;
+	hedge->hosts_len = count;
+	hedge->start_time = g_get_monotonic_time();
+	oma->hedges = g_slist_prepend(oma->hedges, hedge);
+
+	om_session_send_start(oma, hosts[0], hedge);
+	hedge->next_host = 1;
+
+	delay = purple_account_get_int(oma->account, "hedge_delay", 500);
+	if (delay <= 0)
+	{
+		while (hedge->next_host < hedge->hosts_len)
+			om_session_send_start(oma, hosts[hedge->next_host++], hedge);
+	} else {
+		hedge->timer = purple_timeout_add(delay, om_hedge_timeout, hedge);
+	}
+}
+
+void om_sessions_init(OmegleAccount *oma)
+{
+	oma->sessions = g_hash_table_new_full(g_str_hash, g_str_equal,
+			NULL, (GDestroyNotify)om_session_free);
+	oma->poll_watchdog = purple_timeout_add_seconds(
+			OM_POLL_WATCHDOG_INTERVAL, om_poll_watchdog, oma);
+	purple_signal_connect(purple_network_get_handle(),
+			"network-configuration-changed", oma,
+			PURPLE_CALLBACK(om_sessions_network_changed_cb), oma);
+}
+
+void om_sessions_destroy(OmegleAccount *oma)
+{
+	if (oma->poll_watchdog)
+	{
+		purple_timeout_remove(oma->poll_watchdog);
+		oma->poll_watchdog = 0;
+	}
+	if (oma->standby_timer)
+	{
+		purple_timeout_remove(oma->standby_timer);
+		oma->standby_timer = 0;
+	}
+	if (oma->poll_kick_timer)
+	{
+		purple_timeout_remove(oma->poll_kick_timer);
+		oma->poll_kick_timer = 0;
+	}
+	if (oma->recovery_timer)
+	{
+		purple_timeout_remove(oma->recovery_timer);
+		oma->recovery_timer = 0;
+	}
+	if (oma->ui_flush_timer)
+	{
+		purple_timeout_remove(oma->ui_flush_timer);
+		oma->ui_flush_timer = 0;
+	}
+	purple_signal_disconnect(purple_network_get_handle(),
+			"network-configuration-changed", oma,
+			PURPLE_CALLBACK(om_sessions_network_changed_cb));
+
+	while (oma->hedges != NULL)
+		om_hedge_free(oma->hedges->data);
+
+	while (oma->pending_sessions != NULL)
+	{
+		OmegleSession *session = oma->pending_sessions->data;
+		oma->pending_sessions =
+				g_slist_remove(oma->pending_sessions, session);
+		om_session_free(session);
+	}
+
+	g_hash_table_destroy(oma->sessions);
+	oma->sessions = NULL;
+}
+
+/******************************************************************************/
+/* Events */
+/******************************************************************************/
+
+/*
+ * Messages and typing changes aren't shown the moment they are parsed.
+ * They are held until the main loop has nothing else to hand us, so a
+ * burst, whether in one batch or in several that arrived together,
+ * becomes one update per conversation: the messages joined together,
+ * and only the typing state left at the end.  Any other event shows
+ * what is held first, so nothing appears out of order.
+ */
+
+static gboolean om_sessions_ui_flush_cb(gpointer data)
+{
+	OmegleAccount *oma = data;
+
+	oma->ui_flush_timer = 0;
+	while (oma->ui_pending != NULL)
+		om_session_ui_flush(oma->ui_pending->data);
+
+	return FALSE;
+}
+
+static void om_session_ui_queue(OmegleSession *session)
+{
+	OmegleAccount *oma = session->oma;
+
+	oma->stats.ui_events++;
+
+	if (!session->ui_queued)
+	{
+		session->ui_queued = TRUE;
+		oma->ui_pending = g_slist_append(oma->ui_pending, session);
+	}
+	if (oma->ui_flush_timer == 0)
+		oma->ui_flush_timer = purple_timeout_add(0,
+				om_sessions_ui_flush_cb, oma);
+}
+
+/** Takes ownership of html */
+static void om_session_ui_message(OmegleSession *session, gchar *html)
+{
+	if (session->ui_messages == NULL) {
+		session->ui_messages = g_string_new(html);
+	} else {
+		g_string_append(session->ui_messages, "<br>");
+		g_string_append(session->ui_messages, html);
+	}
+	g_free(html);
+
+	/* Showing a message clears the typing state anyway */
+	session->ui_typing_pending = FALSE;
+	om_session_ui_queue(session);
+}
+
+static void om_session_ui_typing(OmegleSession *session,
+		PurpleTypingState state)
+{
+	session->ui_typing_pending = TRUE;
+	session->ui_typing = state;
+	om_session_ui_queue(session);
+}
+
+static void om_session_ui_discard(OmegleSession *session)
+{
+	OmegleAccount *oma = session->oma;
+
+	if (!session->ui_queued)
+		return;
+	session->ui_queued = FALSE;
+	oma->ui_pending = g_slist_remove(oma->ui_pending, session);
+
+	if (session->ui_messages != NULL)
+	{
+		g_string_free(session->ui_messages, TRUE);
+		session->ui_messages = NULL;
+	}
+	session->ui_typing_pending = FALSE;
+}
+
+static void om_session_ui_flush(OmegleSession *session)
+{
+	OmegleAccount *oma = session->oma;
+
+	if (!session->ui_queued)
+		return;
+	session->ui_queued = FALSE;
+	oma->ui_pending = g_slist_remove(oma->ui_pending, session);
+
+	if (session->ui_messages != NULL)
+	{
+		serv_got_im(oma->pc, session->id, session->ui_messages->str,
+				PURPLE_MESSAGE_RECV, time(NULL));
+		g_string_free(session->ui_messages, TRUE);
+		session->ui_messages = NULL;
+		oma->stats.ui_updates++;
+	}
+	if (session->ui_typing_pending)
+	{
+		serv_got_typing(oma->pc, session->id, 10, session->ui_typing);
+		session->ui_typing_pending = FALSE;
+		oma->stats.ui_updates++;
+	}
+}
+
+/**
+ * Hold on to an event for a standby session until somebody claims it.
+ */
+static void om_standby_buffer_event(OmegleSession *session,
+		const gchar *event_type, const gchar *message)
+{
+	OmegleEvent *event;
+
+	if (session->backlog == NULL)
+		session->backlog = g_queue_new();
+
+	event = g_new0(OmegleEvent, 1);
+	event->type = g_strdup(event_type);
+	event->message = g_strdup(message);
+	g_queue_push_tail(session->backlog, event);
+
+	/* Over the limit the oldest chatter goes.  "connected" has to stay,
+	 * om_standby_claim relies on it to start the conversation, and so
+	 * does the stranger leaving. */
+	if (g_queue_get_length(session->backlog) > OM_STANDBY_MAX_BACKLOG)
+	{
+		GList *l;
+
+		for (l = session->backlog->head; l; l = l->next)
+		{
+			event = l->data;
+			if (!g_str_equal(event->type, "connected") &&
+				!g_str_equal(event->type, "strangerDisconnected"))
+			{
+				g_queue_delete_link(session->backlog, l);
+				om_event_free(event);
+				break;
+			}
+		}
+	}
+}
+
+/**
+ * Handle a single event for a session.  Returns FALSE if the session was
+ * dropped as a result and must not be touched any more.
+ */
+static gboolean om_session_dispatch_event(OmegleSession *session,
+		const gchar *event_type, const gchar *message)
+{
+	OmegleAccount *oma = session->oma;
+	const gchar *who = session->id;
+
+	if (session->standby)
+	{
+		if (g_str_equal(event_type, "connected")) {
+			session->state = OM_SESSION_CONNECTED;
+			session->connected_time = g_get_monotonic_time();
+			session->connected_batch = session->batches;
+		} else if (g_str_equal(event_type, "strangerDisconnected")) {
+			/* Nobody ever saw this one, just let it go */
+			om_session_disconnect(oma, who);
+			return FALSE;
+		} else if (g_str_equal(event_type, "waiting")) {
+			return TRUE;
+		}
+		om_standby_buffer_event(session, event_type, message);
+		return TRUE;
+	}
+
+	if (!g_str_equal(event_type, "gotMessage") &&
+		!g_str_equal(event_type, "typing") &&
+		!g_str_equal(event_type, "stoppedTyping"))
+		om_session_ui_flush(session);
+
+	if (g_str_equal(event_type, "waiting")) {
+		/* Only the winner of a hedged start gets a window */
+		if (session->hedge == NULL)
+			serv_got_im(oma->pc, who, "Looking for someone you can chat with. Hang on.", PURPLE_MESSAGE_SYSTEM, time(NULL));
+	} else if (g_str_equal(event_type, "connected")) {
+		if (session->hedge != NULL) {
+			om_hedge_won(session->hedge, session);
+		} else if (session->state != OM_SESSION_CONNECTED) {
+			oma->stats.matches++;
+			oma->stats.match_usec += g_get_monotonic_time() - session->start_time;
+			om_session_first_match(oma);
+		}
+		session->state = OM_SESSION_CONNECTED;
+		/* A standby session already knows when its stranger arrived */
+		if (session->connected_time == 0)
+		{
+			session->connected_time = g_get_monotonic_time();
+			session->connected_batch = session->batches;
+		}
+		serv_got_im(oma->pc, who, "You're now chatting with a random stranger. Say hi!", PURPLE_MESSAGE_SYSTEM, time(NULL));
+	} else if (g_str_equal(event_type, "gotMessage")) {
+		//[["gotMessage","message goes here"]]
+		if (message)
+		{
+			om_log_append(oma, who, OM_LOG_RECEIVED, message);
+
+			om_session_ui_message(session, om_text_to_html(message,
+					purple_account_get_bool(oma->account, "linkify", FALSE)));
+		}
+	} else if (g_str_equal(event_type, "typing")) {
+		om_session_ui_typing(session, PURPLE_TYPING);
+	} else if (g_str_equal(event_type, "stoppedTyping")) {
+		om_session_ui_typing(session, PURPLE_TYPED);
+	} else if (g_str_equal(event_type, "strangerDisconnected")) {
+		session->state = OM_SESSION_DISCONNECTED;
+		serv_got_im(oma->pc, who, "Your conversational partner has disconnected", PURPLE_MESSAGE_SYSTEM, time(NULL));
+	}
+
+	return TRUE;
+}
+
+/**
+ * Get rid of a stranger the spam filter caught, and find a new one if
+ * the user wants that.
+ */
+static void om_session_drop_spam(OmegleSession *session)
+{
+	OmegleAccount *oma = session->oma;
+	gboolean restart = FALSE;
+
+	if (!session->standby)
+	{
+		om_session_ui_flush(session);
+		serv_got_im(oma->pc, session->id, "Disconnected from a suspected spam bot", PURPLE_MESSAGE_SYSTEM, time(NULL));
+		restart = purple_account_get_bool(oma->account, "spam_restart", TRUE);
+	}
+
+	om_session_disconnect(oma, session->id);
+
+	if (restart)
+		om_session_start(oma);
+}
+
+static void om_event_batch_free(OmegleEventBatch *batch)
+{
+	g_list_free_full(batch->events, (GDestroyNotify)om_event_free);
+	g_free(batch);
+}
+
+/**
+ * Turn an /events response into an OmegleEventBatch.  This may run on
+ * the worker thread, so it must not touch libpurple or any session.
+ */
+static gpointer om_events_parse(const gchar *response, gsize len)
+{
+	//[["waiting"], ["connected"]]
+	OmegleEventBatch *batch;
+	OmegleEvent *event;
+	const gchar *event_type;
+	JsonParser *parser;
+	JsonNode *rootnode, *currentnode;
+	JsonArray *array, *current;
+	guint i;
+
+	batch = g_new0(OmegleEventBatch, 1);
+
+	if (!response || !*response || g_str_equal(response, "null"))
+	{
+		batch->null_response = TRUE;
+		return batch;
+	}
+
+	parser = json_parser_new();
+	json_parser_load_from_data(parser, response, len, NULL);
+	rootnode = json_parser_get_root(parser);
+	if (!rootnode || !JSON_NODE_HOLDS_ARRAY(rootnode))
+	{
+		g_object_unref(parser);
+		batch->invalid = TRUE;
+		return batch;
+	}
+	array = json_node_get_array(rootnode);
+
+	for(i=0; i<json_array_get_length(array); i++)
+	{
+		currentnode = json_array_get_element(array, i);
+		if (!JSON_NODE_HOLDS_ARRAY(currentnode))
+			continue;
+		current = json_node_get_array(currentnode);
+		event_type = json_node_get_string(json_array_get_element(current, 0));
+		if (!event_type)
+			continue;
+
+		event = g_new0(OmegleEvent, 1);
+		event->type = g_strdup(event_type);
+		//[["gotMessage","message goes here"]]
+		if (json_array_get_length(current) > 1)
+			event->message = json_node_dup_string(json_array_get_element(current, 1));
+		batch->events = g_list_prepend(batch->events, event);
+	}
+	batch->events = g_list_reverse(batch->events);
+
+	g_object_unref(parser);
+
+	return batch;
+}
+
+/**
+ * Hand a batch's events over in order.  Returns FALSE if the session
+ * went away part way through.
+ */
+static gboolean om_session_dispatch_batch(OmegleSession *session,
+		OmegleEventBatch *batch)
+{
+	OmegleAccount *oma = session->oma;
+	GList *l;
+
+	if (oma->network_lost_time != 0)
+	{
+		/* Heard from the server again, the outage is over */
+		oma->network_lost_time = 0;
+		oma->stats.network_recoveries++;
+	}
+
+	session->batches++;
+
+	if (session->resumed)
+	{
+		session->resumed = FALSE;
+		if (!session->standby && session->state == OM_SESSION_CONNECTED)
+			serv_got_im(oma->pc, session->id, "Reconnected", PURPLE_MESSAGE_SYSTEM, time(NULL));
+	}
+
+	for (l = batch->events; l; l = l->next)
+	{
+		OmegleEvent *event = l->data;
+
+		if (g_str_equal(event->type, "gotMessage") && event->message &&
+			om_filter_is_spam(oma, session, event->message))
+		{
+			om_session_drop_spam(session);
+			return FALSE;
+		}
+
+		if (!om_session_dispatch_event(session, event->type, event->message))
+			return FALSE;
+	}
+
+	return TRUE;
+}
+
+/**
+ * Batches from a streamed /events response, as they arrive.  The poll
+ * stays in flight until the stream ends, at which point om_got_events
+ * gets an empty response.
+ */
+static void om_stream_events(OmegleAccount *oma, gpointer parsed,
+		gpointer userdata)
+{
+	OmegleEventBatch *batch = parsed;
+	OmegleSession *session = userdata;
+
+	if (batch == NULL)
+	{
+		session->streaming = TRUE;
+		oma->stats.streams++;
+		return;
+	}
+
+	oma->stats.streamed_batches++;
+	if (batch->events == NULL)
+		return;
+
+	if (!om_session_dispatch_batch(session, batch))
+	{
+		om_poll_run(oma);
+		return;
+	}
+
+	session->empty_polls = 0;
+	session->last_activity = g_get_monotonic_time();
+}
+
+static void om_got_events(OmegleAccount *oma, gpointer parsed,
+		gpointer userdata)
+{
+	OmegleEventBatch *batch = parsed;
+	OmegleSession *session = userdata;
+
+	/* This request is finished with, don't let anyone cancel it */
+	session->poll_conn = NULL;
+	oma->polls_active--;
+	om_profile_events_cycle();
+
+	if (purple_debug_is_verbose())
+		purple_debug_info("omegle", "got %u events for %s\n",
+				g_list_length(batch->events), session->id);
+
+	if (batch->null_response && oma->network_down)
+	{
+		/* Not the server's answer, the request never got there */
+		om_session_park(session);
+		return;
+	}
+
+	if (session->streaming)
+	{
+		session->streaming = FALSE;
+		/* The end of a stream is no reason to back off */
+		if (batch->null_response && session->state != OM_SESSION_DISCONNECTED)
+		{
+			om_session_queue_poll(session);
+			om_poll_run(oma);
+			return;
+		}
+	}
+
+	if (batch->null_response)
+	{
+		/* After the stranger has gone "null" just means the server has
+		 * forgotten about us.  Otherwise give it a few more tries. */
+		if (session->state == OM_SESSION_DISCONNECTED ||
+			session->empty_polls >= OM_POLL_MAX_EMPTY)
+		{
+			om_session_release(session);
+			return;
+		}
+		om_session_poll_backoff(session);
+		om_poll_run(oma);
+		return;
+	}
+
+	if (!om_session_dispatch_batch(session, batch))
+	{
+		om_poll_run(oma);
+		return;
+	}
+
+	if (batch->events == NULL)
+	{
+		om_session_poll_backoff(session);
+	} else {
+		session->empty_polls = 0;
+		session->last_activity = g_get_monotonic_time();
+		om_session_queue_poll(session);
+	}
+	om_poll_run(oma);
+}
@@ -0,0 +1,128 @@
+/*
+ * libomegle
+ *
+ * libomegle is the property of its developers.  See the COPYRIGHT file
+ * for more details.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef OMEGLE_SESSION_H
+#define OMEGLE_SESSION_H
+
+#include "libomegle.h"
+#include "om_connection.h"
+
+typedef enum
+{
+	OM_SESSION_STARTING = 0,
+	OM_SESSION_WAITING,
+	OM_SESSION_CONNECTED,
+	OM_SESSION_DISCONNECTED
+} OmegleSessionState;
+
+#define OM_STANDBY_MAX_POOL 5
+#define OM_STANDBY_MAX_BACKLOG 50
+#define OM_STANDBY_CHECK_INTERVAL 5
+#define OM_STANDBY_MATCHED_MAX 10 /**< Seconds a stranger is left waiting on standby */
+
+#define OM_DEFAULT_MAX_POLLS 8
+#define OM_POLL_BACKOFF_MIN 500
+#define OM_POLL_BACKOFF_MAX 30000
+#define OM_POLL_MAX_EMPTY 5
+#define OM_POLL_WATCHDOG_INTERVAL 15
+
+#define OM_RECOVERY_RETRY_MIN 1000
+#define OM_RECOVERY_RETRY_MAX 15000
+#define OM_RECOVERY_TIMEOUT 120 /**< Seconds the server keeps a quiet session */
+
+typedef struct _OmegleHedge OmegleHedge;
+typedef struct _OmegleEvent OmegleEvent;
+
+typedef struct _OmegleEventBatch OmegleEventBatch;
+
+struct _OmegleEvent {
+	gchar *type;
+	gchar *message;
+};
+
+/**
+ * One /events response, parsed.
+ */
+struct _OmegleEventBatch {
+	gboolean null_response; /**< Empty or "null", the server has nothing for us */
+	gboolean invalid; /**< Not a JSON array */
+	GList *events; /**< OmegleEvents in the order the server sent them */
+};
+
+struct _OmegleSession {
+	OmegleAccount *oma;
+	gchar *id; /**< NULL until the /start response arrives */
+	gchar *host;
+	OmegleSessionState state;
+	gint64 start_time; /**< When /start was sent, in monotonic usec */
+	OmegleConnection *poll_conn; /**< The in-flight /events request */
+	gboolean poll_queued; /**< Waiting in oma->poll_queue for a slot */
+	guint poll_timer; /**< Backing off before the next poll */
+	guint empty_polls; /**< Empty or "null" responses in a row */
+	gint64 last_activity;
+	OmegleHedge *hedge; /**< Set while this is one of several candidates */
+	gboolean standby; /**< Pre-started, not yet handed to the user */
+	GQueue *backlog; /**< OmegleEvents held back while on standby */
+	gint64 connected_time; /**< When the stranger turned up */
+	guint messages_received;
+	gint64 flood_start;
+	guint flood_count; /**< Batches with messages since flood_start */
+	guint batches; /**< Event batches dispatched, to tell which events came together */
+	guint connected_batch; /**< The one "connected" came in */
+	guint flood_batch; /**< The last one the flood rule counted */
+	gboolean resumed; /**< Polling restarted after the network came back */
+	gboolean streaming; /**< The in-flight poll is an event stream */
+	gboolean ui_queued; /**< In oma->ui_pending */
+	GString *ui_messages; /**< Received messages not shown yet, as HTML */
+	gboolean ui_typing_pending;
+	PurpleTypingState ui_typing;
+};
+
+/**
+ * A hedged start sends /start to several servers, a little apart, and
+ * keeps whichever session reports "connected" first.
+ */
+struct _OmegleHedge {
+	OmegleAccount *oma;
+	gchar **hosts;
+	guint hosts_len;
+	guint next_host;
+	guint outstanding; /**< /start requests still waiting for an id */
+	guint timer;
+	gint64 start_time;
+	GSList *candidates;
+	gboolean won;
+};
+
+void om_sessions_init(OmegleAccount *oma);
+void om_session_start(OmegleAccount *oma);
+void om_standby_refill(OmegleAccount *oma);
+gchar **om_session_hosts(OmegleAccount *oma, guint *len);
+void om_session_touch(OmegleAccount *oma, const gchar *id);
+void om_poll_kick(OmegleAccount *oma);
+gboolean om_sessions_network_lost(OmegleAccount *oma);
+OmegleSession *om_session_find(OmegleAccount *oma, const gchar *id);
+const gchar *om_session_host(OmegleAccount *oma, const gchar *id);
+void om_session_disconnect(OmegleAccount *oma, const gchar *id);
+void om_session_close(OmegleAccount *oma, const gchar *id);
+void om_sessions_disconnect_all(OmegleAccount *oma);
+void om_sessions_destroy(OmegleAccount *oma);
+
+#endif /* OMEGLE_SESSION_H */
@@ -0,0 +1,364 @@
+/*
+ * libomegle
+ *
+ * libomegle is the property of its developers.  See the COPYRIGHT file
+ * for more details.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "om_state.h"
+#include "om_connection.h"
+
+#include <glib/gstdio.h>
+#include <zlib.h>
+
+/*
+ * A small snapshot of what a new login would otherwise have to find out
+ * all over again, kept in the account's directory under purple_user_dir()
+ * as state.dat:
+ *
+ *   OmegleStateHeader
+ *   OmegleStateRecords, each followed by its name and value
+ *   CRC-32 of everything before it
+ *
+ * It is written when the account closes and every few minutes while it
+ * is open, and read back at login.  Anything about it that doesn't add
+ * up gets the whole file ignored; a cold start is always safe.
+ */
+
+typedef struct _OmegleStateHeader OmegleStateHeader;
+typedef struct _OmegleStateRecord OmegleStateRecord;
+
+typedef enum
+{
+	OM_STATE_DNS = 1, /**< Host name and the address it resolved to */
+	OM_STATE_COOKIE
+} OmegleStateKind;
+
+struct _OmegleStateHeader {
+	guint32 magic;
+	guint16 version;
+	guint16 count; /**< Records that follow */
+	gint64 saved; /**< Wall clock, seconds */
+};
+
+struct _OmegleStateRecord {
+	guint8 kind; /**< OmegleStateKind */
+	guint8 name_len;
+	guint16 value_len;
+	guint32 reserved;
+	gint64 expires; /**< Wall clock, seconds */
+};
+
+struct _OmegleState {
+	gchar *path;
+	guint save_timer;
+	guint32 saved_crc; /**< Of the records last written, to skip rewrites */
+};
+
+typedef struct {
+	GString *data;
+	guint count;
+	gint64 now; /**< Wall clock, seconds */
+} OmegleStateWriter;
+
+static void om_state_append(OmegleStateWriter *writer, OmegleStateKind kind,
+		const gchar *name, const gchar *value, gint64 expires)
+{
+	OmegleStateRecord record;
+	gsize name_len, value_len;
+
+	name_len = strlen(name);
+	value_len = strlen(value);
+	if (name_len == 0 || name_len > G_MAXUINT8 || value_len > G_MAXUINT16 ||
+			writer->count == G_MAXUINT16)
+		return;
+
+	memset(&record, 0, sizeof(record));
+	record.kind = kind;
+	record.name_len = name_len;
+	record.value_len = value_len;
+	record.expires = expires;
+
+	g_string_append_len(writer->data, (const gchar *)&record, sizeof(record));
+	g_string_append_len(writer->data, name, name_len);
+	g_string_append_len(writer->data, value, value_len);
+	writer->count++;
+}
+
+static void om_state_dns_cb(const gchar *host, const gchar *ip,
+		gint64 expires, gpointer data)
+{
+	OmegleStateWriter *writer = data;
+	gint64 left;
+
+	left = (expires - g_get_monotonic_time()) / G_USEC_PER_SEC;
+	if (left > 0)
+		om_state_append(writer, OM_STATE_DNS, host, ip, writer->now + left);
+}
+
+static void om_state_cookie_cb(const gchar *name, const gchar *value,
+		OmegleStateWriter *writer)
+{
+	/* We don't keep the expiry the server gave, so every cookie lasts
+	 * as long as the snapshot itself */
+	om_state_append(writer, OM_STATE_COOKIE, name, value,
+			writer->now + OM_STATE_MAX_AGE);
+}
+
+void om_state_save(OmegleAccount *oma)
+{
+	OmegleState *state = oma->state;
+	OmegleStateWriter writer;
+	OmegleStateHeader header;
+	guint32 crc;
+	GError *error = NULL;
+
+	if (state == NULL)
+		return;
+
+	writer.data = g_string_sized_new(1024);
+	writer.count = 0;
+	writer.now = time(NULL);
+
+	memset(&header, 0, sizeof(header));
+	g_string_append_len(writer.data, (const gchar *)&header, sizeof(header));
+	om_dns_cache_foreach(om_state_dns_cb, &writer);
+	g_hash_table_foreach(oma->cookie_table, (GHFunc)om_state_cookie_cb,
+			&writer);
+
+	/* Nothing new since last time, apart from the clock */
+	crc = crc32(0L, (const Bytef *)writer.data->str + sizeof(header),
+			writer.data->len - sizeof(header));
+	if (crc == state->saved_crc)
+	{
+		g_string_free(writer.data, TRUE);
+		return;
+	}
+
+	header.magic = OM_STATE_MAGIC;
+	header.version = OM_STATE_VERSION;
+	header.count = writer.count;
+	header.saved = writer.now;
+	memcpy(writer.data->str, &header, sizeof(header));
+
+	crc = crc32(0L, (const Bytef *)writer.data->str, writer.data->len);
+	g_string_append_len(writer.data, (const gchar *)&crc, sizeof(crc));
+
+	if (g_file_set_contents(state->path, writer.data->str, writer.data->len,
+			&error))
+	{
+		state->saved_crc = crc32(0L,
+				(const Bytef *)writer.data->str + sizeof(header),
+				writer.data->len - sizeof(header) - sizeof(crc));
+	} else {
+		purple_debug_error("omegle", "could not write %s: %s\n",
+				state->path, error->message);
+		g_error_free(error);
+	}
+
+	g_string_free(writer.data, TRUE);
+}
+
+/**
+ * Cookie names and values go straight into request headers, so nothing
+ * that could end or split a header line is let through.
+ */
+static gboolean om_state_cookie_valid(const gchar *name, const gchar *value)
+{
+	const gchar *p;
+
+	for (p = name; *p; p++)
+		if (!g_ascii_isgraph(*p) || *p == '=' || *p == ';')
+			return FALSE;
+	for (p = value; *p; p++)
+		if (!g_ascii_isgraph(*p) || *p == ';')
+			return FALSE;
+
+	return TRUE;
+}
+
+static gboolean om_state_host_valid(const gchar *host)
+{
+	const gchar *p;
+
+	for (p = host; *p; p++)
+		if (!g_ascii_isalnum(*p) && *p != '.' && *p != '-')
+			return FALSE;
+
+	return TRUE;
+}
+
+/**
+ * Check the whole file before taking anything from it, then restore
+ * whatever hasn't expired.  Returns why it was rejected, or NULL.
+ */
+static const gchar *om_state_restore(OmegleAccount *oma, const gchar *data,
+		gsize len)
+{
+	OmegleStateHeader header;
+	OmegleStateRecord record;
+	const gchar *p, *end;
+	gint64 now;
+	guint32 crc;
+	guint count, pass;
+
+	if (len < sizeof(header) + sizeof(crc))
+		return "too short";
+
+	memcpy(&crc, data + len - sizeof(crc), sizeof(crc));
+	len -= sizeof(crc);
+	if (crc != crc32(0L, (const Bytef *)data, len))
+		return "bad checksum";
+
+	memcpy(&header, data, sizeof(header));
+	if (header.magic != OM_STATE_MAGIC)
+		return "not a state file";
+	if (header.version != OM_STATE_VERSION)
+		return "unknown version";
+
+	now = time(NULL);
+	if (header.saved > now + 60 || now - header.saved > OM_STATE_MAX_AGE)
+		return "too old";
+
+	/* The first pass only checks, the second restores */
+	end = data + len;
+	for (pass = 0; pass < 2; pass++)
+	{
+		count = 0;
+		for (p = data + sizeof(header); p < end; count++)
+		{
+			gchar *name, *value;
+			gboolean valid;
+
+			if ((gsize)(end - p) < sizeof(record))
+				return "truncated record";
+			memcpy(&record, p, sizeof(record));
+			p += sizeof(record);
+			if (record.name_len == 0 ||
+					(gsize)(end - p) < (gsize)record.name_len + record.value_len)
+				return "truncated record";
+
+			name = g_strndup(p, record.name_len);
+			value = g_strndup(p + record.name_len, record.value_len);
+			p += record.name_len + record.value_len;
+
+			switch (record.kind)
+			{
+				case OM_STATE_DNS:
+					valid = om_state_host_valid(name) &&
+							purple_ip_address_is_valid(value);
+					if (valid && pass == 1 && record.expires > now &&
+						om_dns_cache_restore(name, value,
+							g_get_monotonic_time() +
+							(record.expires - now) * G_USEC_PER_SEC))
+					{
+						oma->stats.warm_start_addresses++;
+					}
+					break;
+				case OM_STATE_COOKIE:
+					valid = om_state_cookie_valid(name, value);
+					if (valid && pass == 1 && record.expires > now &&
+						g_hash_table_lookup(oma->cookie_table, name) == NULL)
+					{
+						g_hash_table_insert(oma->cookie_table, name, value);
+						name = value = NULL;
+						oma->stats.warm_start_cookies++;
+					}
+					break;
+				default:
+					valid = FALSE;
+					break;
+			}
+
+			g_free(name);
+			g_free(value);
+			if (!valid)
+				return "bad record";
+		}
+
+		if (count != header.count)
+			return "wrong record count";
+	}
+
+	return NULL;
+}
+
+static gboolean om_state_save_cb(gpointer data)
+{
+	OmegleAccount *oma = data;
+
+	om_state_save(oma);
+
+	return TRUE;
+}
+
+void om_state_init(OmegleAccount *oma)
+{
+	OmegleState *state;
+	gchar *dir, *data;
+	const gchar *error;
+	gsize len;
+
+	if (!purple_account_get_bool(oma->account, "warm_start", TRUE))
+		return;
+
+	dir = g_build_filename(purple_user_dir(), "omegle",
+			purple_escape_filename(purple_account_get_username(oma->account)),
+			NULL);
+	if (purple_build_dir(dir, S_IRUSR | S_IWUSR | S_IXUSR) != 0)
+	{
+		purple_debug_error("omegle", "could not create %s\n", dir);
+		g_free(dir);
+		return;
+	}
+
+	state = g_new0(OmegleState, 1);
+	state->path = g_build_filename(dir, "state.dat", NULL);
+	g_free(dir);
+
+	if (g_file_get_contents(state->path, &data, &len, NULL))
+	{
+		error = om_state_restore(oma, data, len);
+		if (error != NULL)
+			purple_debug_warning("omegle", "ignoring %s: %s\n",
+					state->path, error);
+		else
+			purple_debug_info("omegle",
+					"warm start: %u addresses, %u cookies\n",
+					oma->stats.warm_start_addresses,
+					oma->stats.warm_start_cookies);
+		g_free(data);
+	}
+
+	state->save_timer = purple_timeout_add_seconds(OM_STATE_SAVE_INTERVAL,
+			om_state_save_cb, oma);
+	oma->state = state;
+}
+
+void om_state_destroy(OmegleAccount *oma)
+{
+	OmegleState *state = oma->state;
+
+	if (state == NULL)
+		return;
+
+	purple_timeout_remove(state->save_timer);
+	om_state_save(oma);
+
+	g_free(state->path);
+	g_free(state);
+	oma->state = NULL;
+}
@@ -0,0 +1,35 @@
+/*
+ * libomegle
+ *
+ * libomegle is the property of its developers.  See the COPYRIGHT file
+ * for more details.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef OMEGLE_STATE_H
+#define OMEGLE_STATE_H
+
+#include "libomegle.h"
+
+#define OM_STATE_MAGIC 0x4f4d5354 /**< "OMST" */
+#define OM_STATE_VERSION 1
+#define OM_STATE_SAVE_INTERVAL 300 /**< Seconds between snapshots */
+#define OM_STATE_MAX_AGE (6 * 60 * 60) /**< Older snapshots are ignored */
+
+void om_state_init(OmegleAccount *oma);
+void om_state_save(OmegleAccount *oma);
+void om_state_destroy(OmegleAccount *oma);
+
+#endif /* OMEGLE_STATE_H */
@@ -0,0 +1,169 @@
+/*
+ * libomegle
+ *
+ * libomegle is the property of its developers.  See the COPYRIGHT file
+ * for more details.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#include "om_text.h"
+
+/*
+ * Strangers send plain text, but everything we hand to serv_got_im() is
+ * read as HTML.  Most messages contain nothing that needs escaping, so
+ * the scan looks at a machine word at a time and only drops down to
+ * single bytes once a word has something interesting in it.
+ */
+
+#define OM_ONES  G_GUINT64_CONSTANT(0x0101010101010101)
+#define OM_HIGHS G_GUINT64_CONSTANT(0x8080808080808080)
+
+/** Non-zero if any byte of word equals c */
+#define OM_WORD_HAS(word, c) \
+	((((word) ^ (OM_ONES * (c))) - OM_ONES) & ~((word) ^ (OM_ONES * (c))) & OM_HIGHS)
+
+static inline gboolean om_text_special(guchar c)
+{
+	return c == '&' || c == '<' || c == '>' || c == '"' || c == '\n';
+}
+
+/**
+ * Length of the leading run of bytes that can be copied as they are.
+ */
+static gsize om_text_plain_run(const gchar *text, gsize len)
+{
+	gsize i = 0;
+	guint64 word;
+
+	while (i + sizeof(word) <= len)
+	{
+		memcpy(&word, text + i, sizeof(word));
+		if (OM_WORD_HAS(word, '&') || OM_WORD_HAS(word, '<') ||
+			OM_WORD_HAS(word, '>') || OM_WORD_HAS(word, '"') ||
+			OM_WORD_HAS(word, '\n'))
+			break;
+		i += sizeof(word);
+	}
+
+	while (i < len && !om_text_special(text[i]))
+		i++;
+
+	return i;
+}
+
+static void om_text_escape_append(GString *html, const gchar *text, gsize len)
+{
+	gsize run;
+
+	while (len > 0)
+	{
+		run = om_text_plain_run(text, len);
+		if (run > 0)
+			g_string_append_len(html, text, run);
+		if (run == len)
+			break;
+
+		switch (text[run])
+		{
+			case '&': g_string_append(html, "&amp;"); break;
+			case '<': g_string_append(html, "&lt;"); break;
+			case '>': g_string_append(html, "&gt;"); break;
+			case '"': g_string_append(html, "&quot;"); break;
+			case '\n': g_string_append(html, "<br>"); break;
+		}
+		text += run + 1;
+		len -= run + 1;
+	}
+}
+
+/**
+ * If a link starts at p, return its length, otherwise 0.
+ */
+static gsize om_text_link_length(const gchar *text, const gchar *p)
+{
+	const gchar *end;
+
+	/* Only at the start of a word */
+	if (p > text && g_ascii_isalnum(p[-1]))
+		return 0;
+
+	if (g_ascii_strncasecmp(p, "http://", 7) != 0 &&
+		g_ascii_strncasecmp(p, "https://", 8) != 0 &&
+		g_ascii_strncasecmp(p, "www.", 4) != 0)
+		return 0;
+
+	for (end = p; *end && !g_ascii_isspace(*end) &&
+			*end != '<' && *end != '>' && *end != '"'; end++)
+		;
+
+	/* Punctuation at the end is most likely part of the sentence */
+	while (end > p && strchr(".,;:!?)'", end[-1]))
+		end--;
+
+	/* A bare scheme or "www." on its own isn't a link */
+	if (end - p <= 8)
+		return 0;
+
+	return end - p;
+}
+
+/**
+ * Convert a message from a stranger into HTML for the conversation
+ * window, optionally turning web addresses into links.
+ */
+gchar *om_text_to_html(const gchar *text, gboolean linkify)
+{
+	GString *html;
+	const gchar *p, *plain;
+	gsize len, link_len;
+
+	g_return_val_if_fail(text != NULL, NULL);
+
+	len = strlen(text);
+	/* Enough for the common case of a few entities */
+	html = g_string_sized_new(len + len / 8 + 16);
+
+	if (!linkify)
+	{
+		om_text_escape_append(html, text, len);
+		return g_string_free(html, FALSE);
+	}
+
+	plain = text;
+	for (p = text; *p; p++)
+	{
+		if (*p != 'h' && *p != 'H' && *p != 'w' && *p != 'W')
+			continue;
+		link_len = om_text_link_length(text, p);
+		if (link_len == 0)
+			continue;
+
+		om_text_escape_append(html, plain, p - plain);
+		g_string_append(html, "<a href=\"");
+		if (*p == 'w' || *p == 'W')
+			g_string_append(html, "http://");
+		om_text_escape_append(html, p, link_len);
+		g_string_append(html, "\">");
+		om_text_escape_append(html, p, link_len);
+		g_string_append(html, "</a>");
+
+		p += link_len - 1;
+		plain = p + 1;
+	}
+	om_text_escape_append(html, plain, p - plain);
+
+	return g_string_free(html, FALSE);
+}
@@ -0,0 +1,125 @@
+/*
+ * libomegle
+ *
+ * libomegle is the property of its developers.  See the COPYRIGHT file
+ * for more details.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#include "om_trace.h"
+
+/*
+ * Records are written from the main loop and from the worker thread.
+ * Each writer claims its own slot with one atomic add, so nothing is
+ * locked.  A dump taken while a record is being written may show that
+ * one record half updated, which is fine for a diagnostic aid.
+ */
+
+typedef struct _OmegleTraceRecord OmegleTraceRecord;
+
+struct _OmegleTraceRecord {
+	gint64 time; /**< Monotonic usec, 0 for a slot never written */
+	guint32 seq;
+	guint32 conn_id;
+	guint32 value;
+	guint8 event;
+};
+
+static OmegleTraceRecord om_trace_ring[OM_TRACE_SIZE];
+static volatile gint om_trace_next;
+static volatile gint om_trace_next_id;
+
+static const gchar *om_trace_names[OM_TRACE_EVENTS] = {
+	"request",
+	"deferred",
+	"connecting",
+	"connected",
+	"received",
+	"response",
+	"gunzipped",
+	"dispatched",
+	"aborted",
+	"failed",
+	"closed",
+	"streaming"
+};
+
+guint32 om_trace_connection_id(void)
+{
+	return (guint32)g_atomic_int_add(&om_trace_next_id, 1) + 1;
+}
+
+void om_trace(guint32 conn_id, OmegleTraceEvent event, gsize value)
+{
+	guint32 seq;
+	OmegleTraceRecord *record;
+
+	seq = (guint32)g_atomic_int_add(&om_trace_next, 1);
+	record = &om_trace_ring[seq & (OM_TRACE_SIZE - 1)];
+
+	record->seq = seq;
+	record->conn_id = conn_id;
+	record->value = (guint32)MIN(value, G_MAXUINT32);
+	record->event = event;
+	record->time = g_get_monotonic_time();
+}
+
+/**
+ * Oldest record first.  Times are in milliseconds before the newest
+ * record, which is what matters when looking back from a failure.
+ */
+gchar *om_trace_dump(gboolean html)
+{
+	GString *dump;
+	guint32 next, seq, first;
+	gint64 newest = 0;
+	OmegleTraceRecord *record;
+
+	next = (guint32)g_atomic_int_get(&om_trace_next);
+	first = next > OM_TRACE_SIZE ? next - OM_TRACE_SIZE : 0;
+
+	if (next > 0)
+		newest = om_trace_ring[(next - 1) & (OM_TRACE_SIZE - 1)].time;
+
+	dump = g_string_new(NULL);
+	for (seq = first; seq != next; seq++)
+	{
+		record = &om_trace_ring[seq & (OM_TRACE_SIZE - 1)];
+		if (record->time == 0 || record->seq != seq ||
+				record->event >= OM_TRACE_EVENTS)
+			continue;
+
+		g_string_append_printf(dump, "%u -%.3fms conn %u %s %u%s",
+				record->seq, (newest - record->time) / 1000.0, record->conn_id,
+				om_trace_names[record->event], record->value,
+				html ? "<br>" : "\n");
+	}
+
+	if (dump->len == 0)
+		g_string_append(dump, "(empty)");
+
+	return g_string_free(dump, FALSE);
+}
+
+void om_trace_dump_to_debug(void)
+{
+	gchar *dump;
+
+	dump = om_trace_dump(FALSE);
+	purple_debug_error("omegle", "trace of the last %d steps:\n%s\n",
+			OM_TRACE_SIZE, dump);
+	g_free(dump);
+}
@@ -0,0 +1,57 @@
+/*
+ * libomegle
+ *
+ * libomegle is the property of its developers.  See the COPYRIGHT file
+ * for more details.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#ifndef OMEGLE_TRACE_H
+#define OMEGLE_TRACE_H
+
+#include "libomegle.h"
+
+/*
+ * A fixed size ring of compact binary records, one per step a request
+ * goes through.  Recording one costs a clock read and a few stores, so
+ * it is always on; the text is only built when someone asks for it.
+ */
+
+#define OM_TRACE_SIZE 4096 /**< Must be a power of two */
+
+typedef enum
+{
+	OM_TRACE_REQUEST = 0, /**< value: request bytes */
+	OM_TRACE_DEFERRED, /**< Held back by the rate limiter */
+	OM_TRACE_CONNECTING,
+	OM_TRACE_CONNECTED, /**< value: usec spent connecting */
+	OM_TRACE_RECEIVED, /**< value: bytes in this read */
+	OM_TRACE_RESPONSE, /**< value: body bytes */
+	OM_TRACE_GUNZIPPED, /**< value: inflated bytes */
+	OM_TRACE_DISPATCHED, /**< value: body bytes handed to the callback */
+	OM_TRACE_ABORTED, /**< value: bytes received so far */
+	OM_TRACE_FAILED,
+	OM_TRACE_CLOSED,
+	OM_TRACE_STREAMING, /**< The response is an event stream */
+	OM_TRACE_EVENTS
+} OmegleTraceEvent;
+
+guint32 om_trace_connection_id(void);
+void om_trace(guint32 conn_id, OmegleTraceEvent event, gsize value);
+gchar *om_trace_dump(gboolean html);
+void om_trace_dump_to_debug(void);
+
+#endif /* OMEGLE_TRACE_H */
@@ -0,0 +1,183 @@
+/*
+ * libomegle
+ *
+ * libomegle is the property of its developers.  See the COPYRIGHT file
+ * for more details.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "om_worker.h"
+
+/*
+ * A single background thread that takes jobs in the order they are
+ * pushed and hands them back to the main loop in that same order.
+ *
+ * Finished jobs go through a fixed size ring with exactly one producer
+ * (the worker thread) and one consumer (the idle callback on the main
+ * loop), so it needs no locking, only atomic head and tail indexes.
+ * The idle callback hands them over a few milliseconds' worth at a
+ * time, so a burst of responses doesn't hold up redraws or reads.
+ */
+
+struct _OmegleWorker {
+	GThreadPool *pool;
+	OmegleWorkFunc work_func;
+	OmegleWorkDoneFunc done_func;
+	GDestroyNotify discard_func;
+
+	gpointer ring[OM_WORKER_RING_SIZE];
+	volatile gint head; /**< Next slot the main loop reads */
+	volatile gint tail; /**< Next slot the worker writes */
+
+	volatile gint drain_scheduled;
+	volatile gint closing;
+	GSList *overflow; /**< Jobs the worker couldn't hand back while closing */
+};
+
+static gboolean om_worker_ring_push(OmegleWorker *worker, gpointer job)
+{
+	gint tail, next;
+
+	tail = g_atomic_int_get(&worker->tail);
+	next = (tail + 1) % OM_WORKER_RING_SIZE;
+	if (next == g_atomic_int_get(&worker->head))
+		return FALSE;
+
+	worker->ring[tail] = job;
+	g_atomic_int_set(&worker->tail, next);
+
+	return TRUE;
+}
+
+static gpointer om_worker_ring_pop(OmegleWorker *worker)
+{
+	gint head;
+	gpointer job;
+
+	head = g_atomic_int_get(&worker->head);
+	if (head == g_atomic_int_get(&worker->tail))
+		return NULL;
+
+	job = worker->ring[head];
+	g_atomic_int_set(&worker->head, (head + 1) % OM_WORKER_RING_SIZE);
+
+	return job;
+}
+
+static gboolean om_worker_drain(gpointer data)
+{
+	OmegleWorker *worker = data;
+	gpointer job;
+	gint64 deadline;
+
+	/* Clear this first so a job finished while we're draining
+	 * schedules another pass rather than being missed */
+	g_atomic_int_set(&worker->drain_scheduled, 0);
+
+	deadline = g_get_monotonic_time() + OM_WORKER_DRAIN_SLICE;
+	while ((job = om_worker_ring_pop(worker)) != NULL)
+	{
+		worker->done_func(job);
+		if (g_get_monotonic_time() < deadline)
+			continue;
+
+		/* Out of time, let everything else on the main loop have a
+		 * turn.  Keep this source for the rest unless the worker has
+		 * already scheduled another one. */
+		if (g_atomic_int_get(&worker->head) == g_atomic_int_get(&worker->tail))
+			break;
+		return g_atomic_int_compare_and_exchange(&worker->drain_scheduled,
+				0, 1);
+	}
+
+	return FALSE;
+}
+
+static void om_worker_thread(gpointer job, gpointer data)
+{
+	OmegleWorker *worker = data;
+
+	worker->work_func(job);
+
+	while (!om_worker_ring_push(worker, job))
+	{
+		if (g_atomic_int_get(&worker->closing))
+		{
+			/* The main loop is blocked in om_worker_destroy() and
+			 * discards these once this thread has finished */
+			worker->overflow = g_slist_prepend(worker->overflow, job);
+			return;
+		}
+		/* The main loop is behind, give it a moment */
+		g_usleep(1000);
+	}
+
+	if (g_atomic_int_compare_and_exchange(&worker->drain_scheduled, 0, 1))
+		g_idle_add(om_worker_drain, worker);
+}
+
+OmegleWorker *om_worker_new(OmegleWorkFunc work_func,
+		OmegleWorkDoneFunc done_func, GDestroyNotify discard_func)
+{
+	OmegleWorker *worker;
+	GError *error = NULL;
+
+	worker = g_new0(OmegleWorker, 1);
+	worker->work_func = work_func;
+	worker->done_func = done_func;
+	worker->discard_func = discard_func;
+
+	/* One thread only, which is what keeps the results in order */
+	worker->pool = g_thread_pool_new(om_worker_thread, worker, 1, FALSE,
+			&error);
+	if (worker->pool == NULL)
+	{
+		purple_debug_error("omegle", "could not start worker thread: %s\n",
+				error ? error->message : "(unknown)");
+		g_clear_error(&error);
+		g_free(worker);
+		return NULL;
+	}
+
+	return worker;
+}
+
+void om_worker_push(OmegleWorker *worker, gpointer job)
+{
+	g_thread_pool_push(worker->pool, job, NULL);
+}
+
+/**
+ * Stop the worker thread.  Jobs that haven't been handed back yet are
+ * given to discard_func rather than done_func.
+ */
+void om_worker_destroy(OmegleWorker *worker)
+{
+	gpointer job;
+
+	g_atomic_int_set(&worker->closing, 1);
+	g_thread_pool_free(worker->pool, FALSE, TRUE);
+
+	while ((job = om_worker_ring_pop(worker)) != NULL)
+		worker->discard_func(job);
+	worker->overflow = g_slist_reverse(worker->overflow);
+	g_slist_free_full(worker->overflow, worker->discard_func);
+
+	/* An idle drain may still be queued up, it must not find us */
+	if (g_atomic_int_get(&worker->drain_scheduled))
+		g_idle_remove_by_data(worker);
+
+	g_free(worker);
+}
@@ -0,0 +1,49 @@
+/*
+ * libomegle
+ *
+ * libomegle is the property of its developers.  See the COPYRIGHT file
+ * for more details.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef OMEGLE_WORKER_H
+#define OMEGLE_WORKER_H
+
+#include "libomegle.h"
+
+#define OM_WORKER_RING_SIZE 64
+#define OM_WORKER_DRAIN_SLICE 8000 /**< Usec of finished jobs per main loop pass */
+
+typedef struct _OmegleWorker OmegleWorker;
+
+/*
+ * Who owns what: the account, its connections and everything libpurple
+ * hands us belong to the main loop.  A job belongs to whichever side
+ * has it, and the worker thread only ever touches the job itself.
+ * done_func and discard_func are always called on the main loop, so
+ * they may use the account.
+ */
+
+/** Runs on the worker thread, so must not touch libpurple or the account */
+typedef void (*OmegleWorkFunc)(gpointer job);
+/** Runs on the main loop with a job the worker has finished */
+typedef void (*OmegleWorkDoneFunc)(gpointer job);
+
+OmegleWorker *om_worker_new(OmegleWorkFunc work_func,
+		OmegleWorkDoneFunc done_func, GDestroyNotify discard_func);
+void om_worker_push(OmegleWorker *worker, gpointer job);
+void om_worker_destroy(OmegleWorker *worker);
+
+#endif /* OMEGLE_WORKER_H */